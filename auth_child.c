@@ -21,7 +21,8 @@ limitations under the License.
 #include <unistd.h>  // for close, _exit, dup2, execl, fork, pipe
 
 #include "env_settings.h"      // for GetIntSetting
-#include "logging.h"           // for LogErrno, Log
+#include "logging.h"           // for LogErrno, Log, FinishLog
+#include "session_snapshot.h"  // for PassSessionSnapshot
 #include "wait_pgrp.h"         // for KillPgrp, WaitPgrp
 #include "xscreensaver_api.h"  // for ExportWindowID
 
@@ -126,10 +127,12 @@ int WatchAuthChild(Window w, const char *executable, int force_auth,
         // Child process.
         StartPgrp();
         ExportWindowID(w);
+        PassSessionSnapshot();
         close(pc[1]);
         if (pc[0] != 0) {
           if (dup2(pc[0], 0) == -1) {
             LogErrno("dup2");
+            FinishLog();
             _exit(EXIT_FAILURE);
           }
           close(pc[0]);
@@ -139,6 +142,7 @@ int WatchAuthChild(Window w, const char *executable, int force_auth,
               NULL);
         LogErrno("execl");
         sleep(2);  // Reduce log spam or other effects from failed execl.
+        FinishLog();
         _exit(EXIT_FAILURE);
       } else {
         // Parent process after successful fork.
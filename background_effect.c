@@ -0,0 +1,542 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "background_effect.h"
+
+#include <X11/X.h>      // for None, ZPixmap, AllPlanes
+#include <X11/Xlib.h>   // for XImage, XGetImage, XCreatePixmap, XPutImage
+#include <X11/Xutil.h>  // for XDestroyImage
+#include <pthread.h>    // for pthread_create, pthread_join, pthread_t
+#include <stdlib.h>     // for malloc, free
+#include <string.h>     // for strcmp
+#include <time.h>       // for clock_gettime, timespec, CLOCK_MONOTONIC
+#include <unistd.h>     // for sysconf, _SC_NPROCESSORS_ONLN
+
+#ifdef HAVE_XSHM_EXT
+#include <X11/extensions/XShm.h>  // for XShmSegmentInfo, XShmGetImage, XSh...
+#include <sys/ipc.h>              // for IPC_PRIVATE, IPC_CREAT, IPC_RMID
+#include <sys/shm.h>              // for shmat, shmctl, shmdt, shmget
+#endif
+
+#include "env_settings.h"  // for GetIntSetting, GetStringSetting
+#include "logging.h"       // for Log
+
+//! The most threads to filter with.
+#define MAX_THREADS 16
+
+//! Box blurs in each direction, done in pairs to end up back in place. Four
+//! of them are close enough to a Gaussian.
+#define BLUR_PAIRS 2
+
+//! How much of the blur radius is done by downsampling rather than blurring.
+#define BLUR_DOWNSAMPLE_DIVISOR 4
+
+//! The smallest effect size that still hides the screen contents.
+#define MIN_EFFECT_SIZE 8
+
+enum Effect { EFFECT_NONE, EFFECT_BLUR, EFFECT_PIXELATE };
+
+//! The state shared by all threads filtering an image.
+struct Filter {
+  //! The screen contents, in 32 bits per pixel; filtered in place.
+  unsigned char *data;
+  int width, height, bytes_per_line;
+
+  //! The size of a block of screen pixels that becomes one small pixel.
+  int factor;
+  //! The downsampled image.
+  unsigned char *small;
+  //! Scratch space of the same size as small.
+  unsigned char *temp;
+  int small_width, small_height;
+  //! The box blur radius, in small pixels.
+  int radius;
+
+  //! For bilinear upscaling: the left small pixel for each screen column.
+  int *x0;
+  //! For bilinear upscaling: the weight of the right small pixel (0 to 256).
+  int *x_weight;
+};
+
+//! A part of a filter step to run on one thread.
+struct FilterTask {
+  struct Filter *filter;
+  int (*Run)(struct Filter *filter, int begin, int end);
+  int begin, end;
+  //! Whether Run completed; it fails if out of memory.
+  int ok;
+};
+
+static void *RunFilterTask(void *arg) {
+  struct FilterTask *task = arg;
+  task->ok = task->Run(task->filter, task->begin, task->end);
+  return NULL;
+}
+
+/*! \brief Runs a filter step over the range [0, n) split across threads.
+ *
+ * \return Zero if any part of the step failed.
+ */
+static int RunFilterStep(struct Filter *filter,
+                         int (*Run)(struct Filter *filter, int begin, int end),
+                         int n, int num_threads) {
+  struct FilterTask tasks[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  int started[MAX_THREADS];
+  int i;
+  if (num_threads > n) {
+    num_threads = n;
+  }
+  for (i = 0; i < num_threads; ++i) {
+    tasks[i].filter = filter;
+    tasks[i].Run = Run;
+    tasks[i].begin = (int)((long long)n * i / num_threads);
+    tasks[i].end = (int)((long long)n * (i + 1) / num_threads);
+    // The calling thread takes the first part itself.
+    started[i] = i > 0 && pthread_create(&threads[i], NULL, RunFilterTask,
+                                         &tasks[i]) == 0;
+  }
+  for (i = 0; i < num_threads; ++i) {
+    if (!started[i]) {
+      RunFilterTask(&tasks[i]);
+    }
+  }
+  int ok = 1;
+  for (i = 0; i < num_threads; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+    ok = ok && tasks[i].ok;
+  }
+  return ok;
+}
+
+/*! \brief Averages blocks of screen pixels into rows [begin, end) of small.
+ */
+static int Downsample(struct Filter *filter, int begin, int end) {
+  int f = filter->factor;
+  unsigned int *sums = malloc(sizeof(*sums) * 4 * filter->small_width);
+  if (sums == NULL) {
+    return 0;
+  }
+  int sy;
+  for (sy = begin; sy < end; ++sy) {
+    int y_begin = sy * f;
+    int y_end = y_begin + f < filter->height ? y_begin + f : filter->height;
+    int i;
+    for (i = 0; i < 4 * filter->small_width; ++i) {
+      sums[i] = 0;
+    }
+    int y;
+    for (y = y_begin; y < y_end; ++y) {
+      const unsigned char *in =
+          filter->data + (size_t)y * filter->bytes_per_line;
+      int x = 0, sx;
+      for (sx = 0; sx < filter->small_width; ++sx) {
+        int x_end = x + f < filter->width ? x + f : filter->width;
+        unsigned int s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+        for (; x < x_end; ++x, in += 4) {
+          s0 += in[0];
+          s1 += in[1];
+          s2 += in[2];
+          s3 += in[3];
+        }
+        sums[4 * sx] += s0;
+        sums[4 * sx + 1] += s1;
+        sums[4 * sx + 2] += s2;
+        sums[4 * sx + 3] += s3;
+      }
+    }
+    unsigned char *out = filter->small + (size_t)sy * 4 * filter->small_width;
+    int sx;
+    for (sx = 0; sx < filter->small_width; ++sx) {
+      int x_begin = sx * f;
+      int x_end = x_begin + f < filter->width ? x_begin + f : filter->width;
+      unsigned int count = (unsigned int)(x_end - x_begin) * (y_end - y_begin);
+      for (i = 0; i < 4; ++i) {
+        out[4 * sx + i] = (sums[4 * sx + i] + count / 2) / count;
+      }
+    }
+  }
+  free(sums);
+  return 1;
+}
+
+/*! \brief Box blurs n elements of count bytes each, step bytes apart.
+ *
+ * Uses running sums, so the cost does not depend on the radius; the edges are
+ * extended. Blurring vertically with count spanning many pixels keeps the
+ * memory accesses sequential.
+ *
+ * \param sums Scratch space for count sums.
+ */
+static void BoxBlur(const unsigned char *in, unsigned char *out, int n,
+                    size_t step, int count, int radius, unsigned int *sums) {
+  // Dividing by multiplying; the sums stay below 256 * size.
+  unsigned int scale = 65536 / (2 * radius + 1);
+  int c;
+  for (c = 0; c < count; ++c) {
+    sums[c] = 0;
+  }
+  int i;
+  for (i = -radius; i <= radius; ++i) {
+    const unsigned char *element = in + (i < 0 ? 0 : i >= n ? n - 1 : i) * step;
+    for (c = 0; c < count; ++c) {
+      sums[c] += element[c];
+    }
+  }
+  for (i = 0; i < n; ++i) {
+    unsigned char *result = out + i * step;
+    const unsigned char *add =
+        in + (i + radius + 1 < n ? i + radius + 1 : n - 1) * step;
+    const unsigned char *sub = in + (i - radius > 0 ? i - radius : 0) * step;
+    for (c = 0; c < count; ++c) {
+      result[c] = (sums[c] * scale + 32768) >> 16;
+      sums[c] += add[c];
+      sums[c] -= sub[c];
+    }
+  }
+}
+
+/*! \brief Blurs rows [begin, end) of small horizontally.
+ */
+static int BlurRows(struct Filter *filter, int begin, int end) {
+  size_t row_bytes = (size_t)4 * filter->small_width;
+  unsigned int sums[4];
+  int y;
+  for (y = begin; y < end; ++y) {
+    unsigned char *row = filter->small + y * row_bytes;
+    unsigned char *temp = filter->temp + y * row_bytes;
+    int pass;
+    for (pass = 0; pass < BLUR_PAIRS; ++pass) {
+      BoxBlur(row, temp, filter->small_width, 4, 4, filter->radius, sums);
+      BoxBlur(temp, row, filter->small_width, 4, 4, filter->radius, sums);
+    }
+  }
+  return 1;
+}
+
+/*! \brief Blurs columns [begin, end) of small vertically.
+ */
+static int BlurColumns(struct Filter *filter, int begin, int end) {
+  size_t row_bytes = (size_t)4 * filter->small_width;
+  int count = 4 * (end - begin);
+  unsigned int *sums = malloc(sizeof(*sums) * count);
+  if (sums == NULL) {
+    return 0;
+  }
+  unsigned char *columns = filter->small + 4 * begin;
+  unsigned char *temp = filter->temp + 4 * begin;
+  int pass;
+  for (pass = 0; pass < BLUR_PAIRS; ++pass) {
+    BoxBlur(columns, temp, filter->small_height, row_bytes, count,
+            filter->radius, sums);
+    BoxBlur(temp, columns, filter->small_height, row_bytes, count,
+            filter->radius, sums);
+  }
+  free(sums);
+  return 1;
+}
+
+/*! \brief Writes screen rows [begin, end) as blocks of small pixels.
+ */
+static int UpscaleNearest(struct Filter *filter, int begin, int end) {
+  int f = filter->factor;
+  int y;
+  for (y = begin; y < end; ++y) {
+    const unsigned int *in =
+        (const unsigned int *)(filter->small +
+                               (size_t)(y / f) * 4 * filter->small_width);
+    unsigned int *out =
+        (unsigned int *)(filter->data + (size_t)y * filter->bytes_per_line);
+    int x = 0, sx;
+    for (sx = 0; sx < filter->small_width; ++sx) {
+      int x_end = x + f < filter->width ? x + f : filter->width;
+      unsigned int pixel = in[sx];
+      for (; x < x_end; ++x) {
+        out[x] = pixel;
+      }
+    }
+  }
+  return 1;
+}
+
+/*! \brief Finds the small pixels to interpolate between for a screen pixel.
+ *
+ * \param i The screen pixel coordinate.
+ * \param f The downsampling factor.
+ * \param n The size of the small image in this direction.
+ * \param weight Receives the weight of the second pixel, from 0 to 256.
+ * \return The first small pixel coordinate.
+ */
+static int BilinearSource(int i, int f, int n, int *weight) {
+  // Pixel centers: screen pixel i is at small coordinate (i + 0.5) / f - 0.5.
+  int pos = (2 * i + 1) * 128 / f - 128;
+  if (pos < 0) {
+    pos = 0;
+  }
+  int first = pos >> 8;
+  if (first >= n - 1) {
+    *weight = 0;
+    return n - 1;
+  }
+  *weight = pos & 255;
+  return first;
+}
+
+/*! \brief Interpolates between two pixels, two channels at a time.
+ *
+ * \param weight The weight of b, from 0 to 256.
+ */
+static unsigned int Lerp(unsigned int a, unsigned int b, unsigned int weight) {
+  // Each 16 bit lane holds at most 255 * 256, so nothing carries over.
+  unsigned int even =
+      ((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8;
+  unsigned int odd = ((a >> 8) & 0x00FF00FF) * (256 - weight) +
+                     ((b >> 8) & 0x00FF00FF) * weight;
+  return (even & 0x00FF00FF) | (odd & 0xFF00FF00);
+}
+
+/*! \brief Writes screen rows [begin, end) interpolated from small.
+ */
+static int UpscaleBilinear(struct Filter *filter, int begin, int end) {
+  // One extra pixel so the rightmost one can interpolate with itself.
+  unsigned int *row = malloc(sizeof(*row) * (filter->small_width + 1));
+  if (row == NULL) {
+    return 0;
+  }
+  const unsigned int *small = (const unsigned int *)filter->small;
+  int y;
+  for (y = begin; y < end; ++y) {
+    // Vertically first, as that is only needed once per small pixel.
+    int wy;
+    int y0 = BilinearSource(y, filter->factor, filter->small_height, &wy);
+    int y1 = y0 + 1 < filter->small_height ? y0 + 1 : y0;
+    const unsigned int *top = small + (size_t)y0 * filter->small_width;
+    const unsigned int *bottom = small + (size_t)y1 * filter->small_width;
+    int sx;
+    for (sx = 0; sx < filter->small_width; ++sx) {
+      row[sx] = Lerp(top[sx], bottom[sx], wy);
+    }
+    row[filter->small_width] = row[filter->small_width - 1];
+    unsigned int *out =
+        (unsigned int *)(filter->data + (size_t)y * filter->bytes_per_line);
+    int x;
+    for (x = 0; x < filter->width; ++x) {
+      int x0 = filter->x0[x];
+      out[x] = Lerp(row[x0], row[x0 + 1], filter->x_weight[x]);
+    }
+  }
+  free(row);
+  return 1;
+}
+
+static int NumFilterThreads(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) {
+    return 1;
+  }
+  return n > MAX_THREADS ? MAX_THREADS : (int)n;
+}
+
+/*! \brief Applies the effect to an image in place.
+ *
+ * \return Zero if out of memory; the image may then be partially filtered.
+ */
+static int FilterImage(XImage *image, enum Effect effect, int size) {
+  struct Filter filter = {0};
+  filter.data = (unsigned char *)image->data;
+  filter.width = image->width;
+  filter.height = image->height;
+  filter.bytes_per_line = image->bytes_per_line;
+  if (effect == EFFECT_PIXELATE) {
+    filter.factor = size;
+  } else {
+    // Downsampling does most of the blurring, and divides all the following
+    // work by factor^2.
+    filter.factor = size / BLUR_DOWNSAMPLE_DIVISOR;
+    if (filter.factor < 1) {
+      filter.factor = 1;
+    }
+    filter.radius = size / filter.factor / 2;
+    if (filter.radius < 1) {
+      filter.radius = 1;
+    }
+  }
+  filter.small_width = (filter.width + filter.factor - 1) / filter.factor;
+  filter.small_height = (filter.height + filter.factor - 1) / filter.factor;
+  size_t small_bytes = (size_t)4 * filter.small_width * filter.small_height;
+  filter.small = malloc(small_bytes);
+  filter.temp = malloc(small_bytes);
+  filter.x0 = malloc(sizeof(*filter.x0) * filter.width);
+  filter.x_weight = malloc(sizeof(*filter.x_weight) * filter.width);
+  int ok = filter.small != NULL && filter.temp != NULL && filter.x0 != NULL &&
+           filter.x_weight != NULL;
+  if (ok) {
+    int threads = NumFilterThreads();
+    ok = RunFilterStep(&filter, Downsample, filter.small_height, threads);
+    if (ok && effect == EFFECT_PIXELATE) {
+      ok = RunFilterStep(&filter, UpscaleNearest, filter.height, threads);
+    } else if (ok) {
+      int x;
+      for (x = 0; x < filter.width; ++x) {
+        filter.x0[x] = BilinearSource(x, filter.factor, filter.small_width,
+                                      &filter.x_weight[x]);
+      }
+      ok = RunFilterStep(&filter, BlurRows, filter.small_height, threads) &&
+           RunFilterStep(&filter, BlurColumns, filter.small_width, threads) &&
+           RunFilterStep(&filter, UpscaleBilinear, filter.height, threads);
+    }
+  }
+  free(filter.small);
+  free(filter.temp);
+  free(filter.x0);
+  free(filter.x_weight);
+  return ok;
+}
+
+#ifdef HAVE_XSHM_EXT
+static int shm_error = 0;
+
+static int CatchShmError(Display *dpy, XErrorEvent *error) {
+  (void)dpy;
+  (void)error;
+  shm_error = 1;
+  return 0;
+}
+#endif
+
+Pixmap CreateBackgroundEffectPixmap(Display *display, Window root_window,
+                                    int w, int h) {
+  const char *effect_name =
+      GetStringSetting("XSECURELOCK_BACKGROUND_EFFECT", "none");
+  enum Effect effect;
+  if (!strcmp(effect_name, "none")) {
+    return None;
+  } else if (!strcmp(effect_name, "blur")) {
+    effect = EFFECT_BLUR;
+  } else if (!strcmp(effect_name, "pixelate")) {
+    effect = EFFECT_PIXELATE;
+  } else {
+    Log("XSECURELOCK_BACKGROUND_EFFECT not in none/blur/pixelate");
+    return None;
+  }
+  int size = GetIntSetting("XSECURELOCK_BACKGROUND_EFFECT_SIZE", 16);
+  if (size < MIN_EFFECT_SIZE) {
+    Log("XSECURELOCK_BACKGROUND_EFFECT_SIZE %d would leave text readable; "
+        "using %d",
+        size, MIN_EFFECT_SIZE);
+    size = MIN_EFFECT_SIZE;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int depth = DefaultDepth(display, DefaultScreen(display));
+  XImage *image = NULL;
+#ifdef HAVE_XSHM_EXT
+  // Avoid copying a few hundred megabytes through the X11 socket.
+  XShmSegmentInfo shminfo;
+  int use_shm = 0;
+  if (XShmQueryExtension(display)) {
+    image = XShmCreateImage(display,
+                            DefaultVisual(display, DefaultScreen(display)),
+                            depth, ZPixmap, NULL, &shminfo, w, h);
+  }
+  if (image != NULL) {
+    shminfo.shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * h,
+                           IPC_CREAT | 0600);
+    if (shminfo.shmid != -1) {
+      shminfo.shmaddr = image->data = shmat(shminfo.shmid, NULL, 0);
+      if (shminfo.shmaddr != (char *)-1) {
+        shminfo.readOnly = False;
+        shm_error = 0;
+        XErrorHandler old_handler = XSetErrorHandler(CatchShmError);
+        XShmAttach(display, &shminfo);
+        XSync(display, False);
+        shmctl(shminfo.shmid, IPC_RMID, NULL);
+        if (!shm_error) {
+          XShmGetImage(display, root_window, image, 0, 0, AllPlanes);
+          XSync(display, False);
+          if (!shm_error) {
+            use_shm = 1;
+          } else {
+            XShmDetach(display, &shminfo);
+            XSync(display, False);
+          }
+        }
+        XSetErrorHandler(old_handler);
+        if (!use_shm) {
+          shmdt(shminfo.shmaddr);
+        }
+      } else {
+        shmctl(shminfo.shmid, IPC_RMID, NULL);
+      }
+    }
+    if (!use_shm) {
+      image->data = NULL;
+      XDestroyImage(image);
+      image = NULL;
+    }
+  }
+  if (image == NULL)
+#endif
+  {
+    image = XGetImage(display, root_window, 0, 0, w, h, AllPlanes, ZPixmap);
+  }
+  if (image == NULL) {
+    Log("Could not take a snapshot of the screen");
+    return None;
+  }
+
+  Pixmap pixmap = None;
+  // The filters work on any channel order, but need whole bytes per channel.
+  if (image->bits_per_pixel != 32) {
+    Log("Background effect needs 32 bits per pixel, got %d",
+        image->bits_per_pixel);
+  } else if (!FilterImage(image, effect, size)) {
+    Log("Out of memory applying the background effect");
+  } else {
+    pixmap = XCreatePixmap(display, root_window, w, h, depth);
+    GC gc = XCreateGC(display, pixmap, 0, NULL);
+#ifdef HAVE_XSHM_EXT
+    if (use_shm) {
+      XShmPutImage(display, pixmap, gc, image, 0, 0, 0, 0, w, h, False);
+    } else
+#endif
+    {
+      XPutImage(display, pixmap, gc, image, 0, 0, 0, 0, w, h);
+    }
+    XFreeGC(display, gc);
+  }
+
+#ifdef HAVE_XSHM_EXT
+  if (use_shm) {
+    XShmDetach(display, &shminfo);
+    XSync(display, False);
+    shmdt(shminfo.shmaddr);
+    image->data = NULL;
+  }
+#endif
+  XDestroyImage(image);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000L +
+                    (end.tv_nsec - start.tv_nsec) / 1000000L;
+  if (elapsed_ms > 100) {
+    Log("Background effect took %ld ms", elapsed_ms);
+  }
+  return pixmap;
+}
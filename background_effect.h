@@ -0,0 +1,34 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef BACKGROUND_EFFECT_H
+#define BACKGROUND_EFFECT_H
+
+#include <X11/X.h>     // for Pixmap, Window
+#include <X11/Xlib.h>  // for Display
+
+/*! \brief Takes a snapshot of the screen for use as the lock background.
+ *
+ * Applies $XSECURELOCK_BACKGROUND_EFFECT to the current screen contents. Must
+ * be called before any of our windows cover the screen.
+ *
+ * \return A pixmap of the given size, or None if no effect is configured or
+ *   taking the snapshot failed. The caller owns the pixmap.
+ */
+Pixmap CreateBackgroundEffectPixmap(Display *display, Window root_window,
+                                    int w, int h);
+
+#endif
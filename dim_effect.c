@@ -0,0 +1,567 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "dim_effect.h"
+
+#include <X11/Xatom.h>  // for XA_CARDINAL
+#include <math.h>       // for pow, ceil, frexp, nextafter, sqrt
+#include <stdio.h>      // for NULL, snprintf
+#include <stdlib.h>     // for abort, calloc, free, malloc
+#include <string.h>     // for strcmp
+#include <time.h>       // for nanosleep, timespec
+
+#ifdef HAVE_XRANDR_EXT
+#include <X11/extensions/Xrandr.h>  // for XRRGetCrtcGamma, XRRSetCrtcGamma
+#endif
+
+#include "env_settings.h"  // for GetIntSetting, GetDoubleSetting, GetStrin...
+#include "logging.h"       // for Log
+
+// Get the entry of value index of the Bayer matrix for n = 2^power.
+static void Bayer(int index, int power, int *x, int *y) {
+  // M_1 = [1].
+  if (power == 0) {
+    *x = 0;
+    *y = 0;
+    return;
+  }
+  // M_{2n} = [[4Mn 4M_n+2] [4M_n+3 4M_n+1]]
+  int subx, suby;
+  Bayer(index >> 2, power - 1, &subx, &suby);
+  int n = 1 << (power - 1);
+  switch (index & 3) {
+    case 0:
+      *x = subx;
+      *y = suby;
+      break;
+    case 1:
+      *x = subx + n;
+      *y = suby + n;
+      break;
+    case 2:
+      *x = subx + n;
+      *y = suby;
+      break;
+    case 3:
+      *x = subx;
+      *y = suby + n;
+      break;
+    default:
+      // Logically impossible, but clang-analyzer needs help here.
+      abort();
+      break;
+  }
+}
+
+static int HaveCompositor(Display *display) {
+  char buf[64];
+  int buflen =
+      snprintf(buf, sizeof(buf), "_NET_WM_CM_S%d", (int)DefaultScreen(display));
+  if (buflen <= 0 || buflen >= (size_t)sizeof(buf)) {
+    Log("Wow, pretty long screen number you got there");
+    return 0;
+  }
+  Atom atom = XInternAtom(display, buf, False);
+  return XGetSelectionOwner(display, atom) != None;
+}
+
+static int dim_time_ms;
+static double dim_fps;
+static double dim_alpha;
+
+static XColor dim_color;
+
+static void NoCleanup(void *unused_self, Display *unused_display) {
+  (void)unused_self;
+  (void)unused_display;
+}
+
+static void NoRepaint(void *unused_self, Display *unused_display,
+                      Window unused_dim_window, int unused_x, int unused_y,
+                      int unused_w, int unused_h) {
+  // The X server repaints the window background on its own.
+  (void)unused_self;
+  (void)unused_display;
+  (void)unused_dim_window;
+  (void)unused_x;
+  (void)unused_y;
+  (void)unused_w;
+  (void)unused_h;
+}
+
+struct DitherEffect {
+  struct DimEffect super;
+  int pattern_power;
+  int pattern_frames;
+  //! The point each pattern frame adds, in order.
+  XPoint *pattern_points;
+
+  //! The points added by the current frame only.
+  Pixmap pattern;
+  //! The points added by all frames so far, to repaint exposed areas with.
+  Pixmap accumulated_pattern;
+  XGCValues gc_values;
+  GC dim_gc, pattern_gc, pattern_clear_gc;
+};
+
+static void DitherEffectPreCreateWindow(void *unused_self,
+                                        Display *unused_display,
+                                        XSetWindowAttributes *unused_dimattrs,
+                                        unsigned long *unused_dimmask) {
+  (void)unused_self;
+  (void)unused_display;
+  (void)unused_dimattrs;
+  *unused_dimmask = *unused_dimmask;  // Shut up clang-analyzer.
+}
+
+static void DitherEffectPostCreateWindow(void *self, Display *display,
+                                         Window dim_window) {
+  struct DitherEffect *dimmer = self;
+
+  // Create a pixmap to define the pattern we want to set as the window shape.
+  dimmer->gc_values.foreground = 0;
+  dimmer->pattern =
+      XCreatePixmap(display, dim_window, 1 << dimmer->pattern_power,
+                    1 << dimmer->pattern_power, 1);
+  dimmer->accumulated_pattern =
+      XCreatePixmap(display, dim_window, 1 << dimmer->pattern_power,
+                    1 << dimmer->pattern_power, 1);
+  dimmer->pattern_clear_gc =
+      XCreateGC(display, dimmer->pattern, GCForeground, &dimmer->gc_values);
+  XFillRectangle(display, dimmer->accumulated_pattern,
+                 dimmer->pattern_clear_gc, 0, 0, 1 << dimmer->pattern_power,
+                 1 << dimmer->pattern_power);
+  dimmer->gc_values.foreground = 1;
+  dimmer->pattern_gc =
+      XCreateGC(display, dimmer->pattern, GCForeground, &dimmer->gc_values);
+
+  // Create a pixmap to define the shape of the screen-filling window (which
+  // will increase over time).
+  dimmer->gc_values.fill_style = FillStippled;
+  dimmer->gc_values.foreground = dim_color.pixel;
+  dimmer->gc_values.stipple = dimmer->pattern;
+  dimmer->dim_gc =
+      XCreateGC(display, dim_window, GCFillStyle | GCForeground | GCStipple,
+                &dimmer->gc_values);
+}
+
+static void DitherEffectDrawFrame(void *self, Display *display,
+                                  Window dim_window, int frame, int w, int h) {
+  struct DitherEffect *dimmer = self;
+
+  // Move the pattern forward to the next display frame. One display frame can
+  // have multiple pattern frames.
+  int start_pframe = frame * dimmer->pattern_frames / dimmer->super.frame_count;
+  int end_pframe =
+      (frame + 1) * dimmer->pattern_frames / dimmer->super.frame_count;
+  if (end_pframe == start_pframe) {
+    return;
+  }
+
+  // The window keeps what previous frames drew, so only the points added by
+  // this frame need to be drawn.
+  XFillRectangle(display, dimmer->pattern, dimmer->pattern_clear_gc, 0, 0,
+                 1 << dimmer->pattern_power, 1 << dimmer->pattern_power);
+  XDrawPoints(display, dimmer->pattern, dimmer->pattern_gc,
+              dimmer->pattern_points + start_pframe, end_pframe - start_pframe,
+              CoordModeOrigin);
+  XDrawPoints(display, dimmer->accumulated_pattern, dimmer->pattern_gc,
+              dimmer->pattern_points + start_pframe, end_pframe - start_pframe,
+              CoordModeOrigin);
+
+  // Draw the pattern on the window. Setting the stipple again makes sure the
+  // server doesn't use a stale copy of it.
+  XChangeGC(display, dimmer->dim_gc, GCStipple, &dimmer->gc_values);
+  XFillRectangle(display, dim_window, dimmer->dim_gc, 0, 0, w, h);
+}
+
+static void DitherEffectRepaint(void *self, Display *display, Window dim_window,
+                                int x, int y, int w, int h) {
+  struct DitherEffect *dimmer = self;
+
+  // Exposed areas lost what previous frames drew, so draw all of it again.
+  // DrawFrame switches back to the delta pattern.
+  XSetStipple(display, dimmer->dim_gc, dimmer->accumulated_pattern);
+  XFillRectangle(display, dim_window, dimmer->dim_gc, x, y, w, h);
+}
+
+static void DitherEffectInit(struct DitherEffect *dimmer,
+                             Display *unused_display) {
+  (void)unused_display;
+
+  // Ensure dimming at least at a defined frame rate.
+  dimmer->pattern_power = 3;
+  // Total time of effect if we wouldn't stop after dim_alpha of fading out.
+  double total_time_ms = dim_time_ms / dim_alpha;
+  // Minimum "total" frame count of the animation.
+  double total_frames_min = total_time_ms / 1000.0 * dim_fps;
+  // This actually computes ceil(log2(sqrt(total_frames_min))) but cannot fail.
+  (void)frexp(sqrt(total_frames_min), &dimmer->pattern_power);
+  // Clip extreme/unsupported values.
+  if (dimmer->pattern_power < 2) {
+    dimmer->pattern_power = 2;
+  }
+  if (dimmer->pattern_power > 8) {
+    dimmer->pattern_power = 8;
+  }
+  // Generate the frame count and vtable.
+  dimmer->pattern_frames = ceil(pow(1 << dimmer->pattern_power, 2) * dim_alpha);
+  dimmer->pattern_points =
+      malloc(sizeof(*dimmer->pattern_points) * dimmer->pattern_frames);
+  if (dimmer->pattern_points == NULL) {
+    Log("Out of memory for the dither pattern - not dimming");
+    dimmer->pattern_frames = 0;
+  }
+  int pframe;
+  for (pframe = 0; pframe < dimmer->pattern_frames; ++pframe) {
+    int x, y;
+    Bayer(pframe, dimmer->pattern_power, &x, &y);
+    dimmer->pattern_points[pframe].x = x;
+    dimmer->pattern_points[pframe].y = y;
+  }
+  dimmer->super.frame_count = ceil(dim_time_ms * dim_fps / 1000.0);
+  dimmer->super.time_ms = dim_time_ms;
+  dimmer->super.PreCreateWindow = DitherEffectPreCreateWindow;
+  dimmer->super.PostCreateWindow = DitherEffectPostCreateWindow;
+  dimmer->super.DrawFrame = DitherEffectDrawFrame;
+  dimmer->super.Repaint = DitherEffectRepaint;
+  dimmer->super.Cleanup = NoCleanup;
+}
+
+struct OpacityEffect {
+  struct DimEffect super;
+
+  Atom property_atom;
+  double dim_color_brightness;
+};
+
+static void OpacityEffectPreCreateWindow(void *unused_self,
+                                         Display *unused_display,
+                                         XSetWindowAttributes *dimattrs,
+                                         unsigned long *dimmask) {
+  (void)unused_self;
+  (void)unused_display;
+
+  dimattrs->background_pixel = dim_color.pixel;
+  *dimmask |= CWBackPixel;
+}
+
+static void OpacityEffectPostCreateWindow(void *self, Display *display,
+                                          Window dim_window) {
+  struct OpacityEffect *dimmer = self;
+
+  long value = 0;
+  XChangeProperty(display, dim_window, dimmer->property_atom, XA_CARDINAL, 32,
+                  PropModeReplace, (unsigned char *)&value, 1);
+}
+
+static double sRGBToLinear(double value) {
+  return (value <= 0.04045) ? value / 12.92 : pow((value + 0.055) / 1.055, 2.4);
+}
+
+static double LinearTosRGB(double value) {
+  return (value <= 0.0031308) ? 12.92 * value
+                              : 1.055 * pow(value, 1.0 / 2.4) - 0.055;
+}
+
+static void OpacityEffectDrawFrame(void *self, Display *display,
+                                   Window dim_window, int frame, int unused_w,
+                                   int unused_h) {
+  struct OpacityEffect *dimmer = self;
+  (void)unused_w;
+  (void)unused_h;
+
+  // Calculate the linear-space alpha we want to be fading to.
+  double linear_alpha = (frame + 1) * dim_alpha / dimmer->super.frame_count;
+  double linear_min = linear_alpha * dimmer->dim_color_brightness;
+  double linear_max =
+      linear_alpha * dimmer->dim_color_brightness + (1.0 - linear_alpha);
+
+  // Calculate the sRGB-space alpha we thus must select to get the same color
+  // range.
+  double srgb_min = LinearTosRGB(linear_min);
+  double srgb_max = LinearTosRGB(linear_max);
+  double srgb_alpha = 1.0 - (srgb_max - srgb_min);
+  // Note: this may have a different brightness level, here we're simply
+  // solving for the same contrast as the "dither" mode.
+
+  // Log("Got: [%f..%f], want: [%f..%f]",
+  //     srgb_alpha * LinearTosRGB(dimmer->dim_color_brightness),
+  //     srgb_alpha * LinearTosRGB(dimmer->dim_color_brightness) +
+  //         (1.0 - srgb_alpha),
+  //     srgb_min, srgb_max);
+
+  // Convert to an opacity value.
+  long value = nextafter(0xffffffff, 0) * srgb_alpha;
+  XChangeProperty(display, dim_window, dimmer->property_atom, XA_CARDINAL, 32,
+                  PropModeReplace, (unsigned char *)&value, 1);
+}
+
+static void OpacityEffectInit(struct OpacityEffect *dimmer,
+                              Display *display) {
+  dimmer->property_atom = XInternAtom(display, "_NET_WM_WINDOW_OPACITY", False);
+  dimmer->dim_color_brightness =
+      sRGBToLinear(dim_color.red / 65535.0) * 0.2126 +
+      sRGBToLinear(dim_color.green / 65535.0) * 0.7152 +
+      sRGBToLinear(dim_color.blue / 65535.0) * 0.0722;
+
+  // Generate the frame count and vtable.
+  dimmer->super.frame_count = ceil(dim_time_ms * dim_fps / 1000.0);
+  dimmer->super.time_ms = dim_time_ms;
+  dimmer->super.PreCreateWindow = OpacityEffectPreCreateWindow;
+  dimmer->super.PostCreateWindow = OpacityEffectPostCreateWindow;
+  dimmer->super.DrawFrame = OpacityEffectDrawFrame;
+  dimmer->super.Repaint = NoRepaint;
+  dimmer->super.Cleanup = NoCleanup;
+}
+
+#ifdef HAVE_XRANDR_EXT
+//! The gamma ramps of one CRTC.
+struct GammaCrtc {
+  RRCrtc crtc;
+  //! The ramps to restore when done.
+  XRRCrtcGamma *original;
+  //! The ramps being faded.
+  XRRCrtcGamma *current;
+  //! The original ramps in linear space, red, green and blue after each other.
+  double *linear;
+};
+
+struct GammaEffect {
+  struct DimEffect super;
+
+  struct GammaCrtc *crtcs;
+  int num_crtcs;
+  //! The dim color in linear space.
+  double dim_color_linear[3];
+};
+
+static void GammaEffectPreCreateWindow(void *unused_self,
+                                       Display *unused_display,
+                                       XSetWindowAttributes *unused_dimattrs,
+                                       unsigned long *unused_dimmask) {
+  (void)unused_self;
+  (void)unused_display;
+  (void)unused_dimattrs;
+  // No background, so the window keeps showing what was below it.
+  *unused_dimmask = *unused_dimmask;  // Shut up clang-analyzer.
+}
+
+static void GammaEffectPostCreateWindow(void *unused_self,
+                                        Display *unused_display,
+                                        Window unused_dim_window) {
+  (void)unused_self;
+  (void)unused_display;
+  (void)unused_dim_window;
+}
+
+static void GammaEffectDrawFrame(void *self, Display *display,
+                                 Window unused_dim_window, int frame,
+                                 int unused_w, int unused_h) {
+  struct GammaEffect *dimmer = self;
+  (void)unused_dim_window;
+  (void)unused_w;
+  (void)unused_h;
+
+  // Same linear-space blend as what the "dither" mode does spatially.
+  double linear_alpha = (frame + 1) * dim_alpha / dimmer->super.frame_count;
+  int i;
+  for (i = 0; i < dimmer->num_crtcs; ++i) {
+    struct GammaCrtc *crtc = &dimmer->crtcs[i];
+    int size = crtc->current->size;
+    unsigned short *ramps[3] = {crtc->current->red, crtc->current->green,
+                                crtc->current->blue};
+    int c, j;
+    for (c = 0; c < 3; ++c) {
+      const double *linear = crtc->linear + c * size;
+      double dimmed = linear_alpha * dimmer->dim_color_linear[c];
+      for (j = 0; j < size; ++j) {
+        double value =
+            LinearTosRGB(linear[j] * (1.0 - linear_alpha) + dimmed);
+        ramps[c][j] = value <= 0 ? 0 : value >= 1 ? 65535 : value * 65535 + 0.5;
+      }
+    }
+    XRRSetCrtcGamma(display, crtc->crtc, crtc->current);
+  }
+}
+
+static void GammaEffectCleanup(void *self, Display *display) {
+  struct GammaEffect *dimmer = self;
+  int i;
+  for (i = 0; i < dimmer->num_crtcs; ++i) {
+    XRRSetCrtcGamma(display, dimmer->crtcs[i].crtc,
+                    dimmer->crtcs[i].original);
+  }
+  XFlush(display);
+}
+
+/*! \brief Saves the gamma ramps of all CRTCs.
+ *
+ * \return Zero if gamma ramps can't be used for dimming.
+ */
+static int GammaEffectInit(struct GammaEffect *dimmer, Display *display) {
+  int event_base, error_base, major, minor;
+  if (!XRRQueryExtension(display, &event_base, &error_base) ||
+      !XRRQueryVersion(display, &major, &minor) ||
+      (major == 1 && minor < 2)) {
+    Log("XRandR 1.2 is needed for the gamma dim effect");
+    return 0;
+  }
+  // Like in monitors.c, avoid probing all outputs if possible.
+  XRRScreenResources *screenres =
+      (major > 1 || minor >= 3)
+          ? XRRGetScreenResourcesCurrent(display, DefaultRootWindow(display))
+          : XRRGetScreenResources(display, DefaultRootWindow(display));
+  if (screenres == NULL) {
+    Log("Could not query the CRTCs for the gamma dim effect");
+    return 0;
+  }
+  dimmer->crtcs = calloc(screenres->ncrtc, sizeof(*dimmer->crtcs));
+  dimmer->num_crtcs = 0;
+  int i;
+  for (i = 0; dimmer->crtcs != NULL && i < screenres->ncrtc; ++i) {
+    int size = XRRGetCrtcGammaSize(display, screenres->crtcs[i]);
+    if (size <= 0) {
+      continue;
+    }
+    struct GammaCrtc *crtc = &dimmer->crtcs[dimmer->num_crtcs];
+    crtc->crtc = screenres->crtcs[i];
+    crtc->original = XRRGetCrtcGamma(display, crtc->crtc);
+    crtc->current = XRRAllocGamma(size);
+    crtc->linear = malloc(sizeof(*crtc->linear) * 3 * size);
+    if (crtc->original == NULL || crtc->original->size != size ||
+        crtc->current == NULL || crtc->linear == NULL) {
+      if (crtc->original != NULL) {
+        XRRFreeGamma(crtc->original);
+      }
+      if (crtc->current != NULL) {
+        XRRFreeGamma(crtc->current);
+      }
+      free(crtc->linear);
+      continue;
+    }
+    const unsigned short *ramps[3] = {
+        crtc->original->red, crtc->original->green, crtc->original->blue};
+    int c, j;
+    for (c = 0; c < 3; ++c) {
+      for (j = 0; j < size; ++j) {
+        crtc->linear[c * size + j] = sRGBToLinear(ramps[c][j] / 65535.0);
+      }
+    }
+    ++dimmer->num_crtcs;
+  }
+  XRRFreeScreenResources(screenres);
+  if (dimmer->num_crtcs == 0) {
+    Log("No CRTC supports gamma ramps");
+    free(dimmer->crtcs);
+    dimmer->crtcs = NULL;
+    return 0;
+  }
+  dimmer->dim_color_linear[0] = sRGBToLinear(dim_color.red / 65535.0);
+  dimmer->dim_color_linear[1] = sRGBToLinear(dim_color.green / 65535.0);
+  dimmer->dim_color_linear[2] = sRGBToLinear(dim_color.blue / 65535.0);
+
+  // Generate the frame count and vtable.
+  dimmer->super.frame_count = ceil(dim_time_ms * dim_fps / 1000.0);
+  dimmer->super.time_ms = dim_time_ms;
+  dimmer->super.PreCreateWindow = GammaEffectPreCreateWindow;
+  dimmer->super.PostCreateWindow = GammaEffectPostCreateWindow;
+  dimmer->super.DrawFrame = GammaEffectDrawFrame;
+  dimmer->super.Repaint = NoRepaint;
+  dimmer->super.Cleanup = GammaEffectCleanup;
+  return 1;
+}
+#endif
+
+struct DimEffect *InitDimEffect(Display *display) {
+  static struct DitherEffect dither_dimmer;
+  static struct OpacityEffect opacity_dimmer;
+#ifdef HAVE_XRANDR_EXT
+  static struct GammaEffect gamma_dimmer;
+#endif
+
+  // Load global settings.
+  dim_time_ms = GetIntSetting("XSECURELOCK_DIM_TIME_MS", 2000);
+  dim_fps = GetDoubleSetting(
+      "XSECURELOCK_DIM_FPS",
+      GetDoubleSetting("XSECURELOCK_" /* REMOVE IN v2 */ "DIM_MIN_FPS", 60));
+  dim_alpha = GetDoubleSetting("XSECURELOCK_DIM_ALPHA", 0.875);
+  const char *effect = GetStringSetting("XSECURELOCK_DIM_EFFECT", "auto");
+
+  if (dim_alpha <= 0 || dim_alpha > 1) {
+    Log("XSECURELOCK_DIM_ALPHA must be in ]0..1] - using default");
+    dim_alpha = 0.875;
+  }
+
+  // Prepare the background color.
+  Colormap colormap = DefaultColormap(display, DefaultScreen(display));
+  const char *color_name = GetStringSetting("XSECURELOCK_DIM_COLOR", "black");
+  XParseColor(display, colormap, color_name, &dim_color);
+  if (XAllocColor(display, colormap, &dim_color)) {
+    // Log("Allocated color %lu = %d %d %d", dim_color.pixel, dim_color.red,
+    //     dim_color.green, dim_color.blue);
+  } else {
+    dim_color.pixel = BlackPixel(display, DefaultScreen(display));
+    XQueryColor(display, colormap, &dim_color);
+    Log("Could not allocate color or unknown color name: %s", color_name);
+  }
+
+  // Set up the filter.
+  if (!strcmp(effect, "gamma")) {
+#ifdef HAVE_XRANDR_EXT
+    if (GammaEffectInit(&gamma_dimmer, display)) {
+      return &gamma_dimmer.super;
+    }
+#else
+    Log("Gamma dim effect not compiled in");
+#endif
+    effect = "auto";
+  }
+  if (!strcmp(effect, "auto")) {
+    effect = GetIntSetting("XSECURELOCK_DIM_OVERRIDE_COMPOSITOR_DETECTION",
+                           HaveCompositor(display))
+                 ? "opacity"
+                 : "dither";
+  }
+  if (!strcmp(effect, "opacity")) {
+    OpacityEffectInit(&opacity_dimmer, display);
+    return &opacity_dimmer.super;
+  }
+  if (strcmp(effect, "dither")) {
+    Log("XSECURELOCK_DIM_EFFECT not in auto/dither/opacity/gamma - using "
+        "dither");
+  }
+  DitherEffectInit(&dither_dimmer, display);
+  return &dither_dimmer.super;
+}
+
+int SleepDimFrame(const struct DimEffect *dimmer) {
+  unsigned long long sleep_time_ns =
+      (dimmer->time_ms * 1000000ULL) / dimmer->frame_count;
+  struct timespec sleep_ts;
+  sleep_ts.tv_sec = sleep_time_ns / 1000000000;
+  sleep_ts.tv_nsec = sleep_time_ns % 1000000000;
+  return nanosleep(&sleep_ts, NULL) == 0;
+}
+
+void RepaintDimExposures(struct DimEffect *dimmer, Display *display,
+                         Window dim_window) {
+  XEvent ev;
+  while (XCheckTypedWindowEvent(display, dim_window, Expose, &ev)) {
+    dimmer->Repaint(dimmer, display, dim_window, ev.xexpose.x, ev.xexpose.y,
+                    ev.xexpose.width, ev.xexpose.height);
+  }
+}
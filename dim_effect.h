@@ -0,0 +1,66 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef DIM_EFFECT_H
+#define DIM_EFFECT_H
+
+#include <X11/X.h>     // for Window
+#include <X11/Xlib.h>  // for Display, XSetWindowAttributes
+
+//! A method of fading the screen to a color on a screen-filling window.
+struct DimEffect {
+  void (*PreCreateWindow)(void *self, Display *display,
+                          XSetWindowAttributes *dimattrs,
+                          unsigned long *dimmask);
+  void (*PostCreateWindow)(void *self, Display *display, Window dim_window);
+  void (*DrawFrame)(void *self, Display *display, Window dim_window, int frame,
+                    int w, int h);
+  //! Redraws an exposed area of the dim window as of the last drawn frame.
+  void (*Repaint)(void *self, Display *display, Window dim_window, int x, int y,
+                  int w, int h);
+  //! Undoes what the effect did outside the dim window; call when done dimming.
+  void (*Cleanup)(void *self, Display *display);
+
+  //! The number of frames to draw.
+  int frame_count;
+  //! The total duration of the effect.
+  int time_ms;
+};
+
+/*! \brief Sets up the dim effect according to the dim settings.
+ *
+ * Uses the effect from $XSECURELOCK_DIM_EFFECT. By default, picks an opacity
+ * based effect if a compositor is running, and a dithering effect otherwise.
+ *
+ * \return The effect; it lives until the program exits.
+ */
+struct DimEffect *InitDimEffect(Display *display);
+
+/*! \brief Sleeps for the duration of one frame of the effect.
+ *
+ * \return Zero if the sleep was interrupted.
+ */
+int SleepDimFrame(const struct DimEffect *dimmer);
+
+/*! \brief Repaints the areas of the dim window that got exposed.
+ *
+ * Handles the queued Expose events of the dim window, which must have selected
+ * ExposureMask; other events stay queued.
+ */
+void RepaintDimExposures(struct DimEffect *dimmer, Display *display,
+                         Window dim_window);
+
+#endif
@@ -18,7 +18,7 @@
 
 # List all settings (usually from Get*Settings call).
 all_settings=$(
-	for file in *.[ch] */*.[ch] */auth_* */saver_*; do
+	for file in *.[ch] */*.[ch] */auth_* */media_index */saver_*; do
 		<"$file" perl -ne '
 			print "$_\n" for /\bXSECURELOCK_[A-Za-z0-9_%]+\b/g;
 		'
@@ -28,6 +28,7 @@ all_settings=$(
 # List of internal settings. These shall not be documented.
 internal_settings='
 XSECURELOCK_INSIDE_SAVER_MULTIPLEX
+XSECURELOCK_SESSION_FD
 '
 
 # List of deprecated settings. These shall not be documented.
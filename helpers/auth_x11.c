@@ -16,19 +16,19 @@ limitations under the License.
 
 #include <X11/X.h>       // for Success, None, Atom, KBBellPitch
 #include <X11/Xlib.h>    // for DefaultScreen, Screen, XFree, True
+#include <errno.h>       // for errno, EINTR
 #include <locale.h>      // for NULL, setlocale, LC_CTYPE, LC_TIME
 #include <stdlib.h>      // for free, rand, mblen, size_t, EXIT_...
 #include <stdio.h>
 #include <string.h>      // for strlen, memcpy, memset, strcspn
 #include <sys/select.h>  // for timeval, select, fd_set, FD_SET
 #include <sys/time.h>    // for gettimeofday, timeval
-#include <time.h>        // for time, nanosleep, localtime_r
+#include <time.h>        // for time, nanosleep, clock_gettime, loc...
 #include <unistd.h>      // for close, _exit, dup2, pipe, dup
 
 #ifdef HAVE_XFT_EXT
 #include <X11/Xft/Xft.h>             // for XftColorAllocValue, XftColorFree
-#include <X11/extensions/Xrender.h>  // for XRenderColor, XGlyphInfo
-#include <fontconfig/fontconfig.h>   // for FcChar8
+#include <X11/extensions/Xrender.h>  // for XRenderColor
 #endif
 
 #ifdef HAVE_XKB_EXT
@@ -39,14 +39,16 @@ limitations under the License.
 
 #include "../env_info.h"          // for GetHostName, GetUserName
 #include "../env_settings.h"      // for GetIntSetting, GetStringSetting
-#include "../logging.h"           // for Log, LogErrno
+#include "../logging.h"           // for Log, LogErrno, FinishLog
 #include "../mlock_page.h"        // for MLOCK_PAGE
+#include "../session_snapshot.h"  // for GetSessionSnapshot, AllocAuthC...
 #include "../util.h"              // for explicit_bzero
 #include "../wait_pgrp.h"         // for WaitPgrp
 #include "../wm_properties.h"     // for SetWMProperties
 #include "../xscreensaver_api.h"  // for ReadWindowID
 #include "authproto.h"            // for WritePacket, ReadPacket, PTYPE_R...
 #include "monitors.h"             // for Monitor, GetMonitors, IsMonitorC...
+#include "text.h"                 // for DrawText, LoadFont, TextAdvance
 
 #if __STDC_VERSION__ >= 201112L
 #define ASSERT(state, message) _Static_assert(state, message)
@@ -66,6 +68,9 @@ const char *authproto_executable;
 //! The blinking interval in microseconds.
 #define BLINK_INTERVAL (250 * 1000)
 
+//! The delay before redrawing after X11 events in microseconds (one frame).
+#define EVENT_REDRAW_DELAY (1000 * 1000 / 60)
+
 //! The maximum time to wait at a prompt for user input in seconds.
 int prompt_timeout;
 
@@ -193,14 +198,13 @@ Window main_window;
 //! main_window's parent. Used to create per-monitor siblings.
 Window parent_window;
 
-//! The X11 core font for the PAM messages.
-XFontStruct *core_font;
+//! The font for the PAM messages.
+struct Font font;
 
 #ifdef HAVE_XFT_EXT
-//! The Xft font for the PAM messages.
+//! The Xft colors for the PAM messages.
 XftColor xft_color_foreground;
 XftColor xft_color_warning;
-XftFont *xft_font;
 #endif
 
 //! The background color.
@@ -275,47 +279,189 @@ int sounds[][2] = {
 #define SOUND_SLEEP_MS 125
 #define SOUND_TONE_MS 100
 
-/*! \brief Play a sound sequence.
+//! The maximum number of sounds waiting to be played.
+#define SOUND_QUEUE_SIZE 4
+
+//! Sounds waiting to be played.
+enum Sound sound_queue[SOUND_QUEUE_SIZE];
+
+//! The index of the next sound in sound_queue.
+int sound_queue_start = 0;
+
+//! The number of sounds in sound_queue.
+int sound_queue_length = 0;
+
+//! The sound currently playing.
+enum Sound sound_playing;
+
+//! The next step of sound_playing; 0 if idle, 1 for the second note, 2 for
+//! the pause after it.
+int sound_step = 0;
+
+//! When the next step of sound_playing is due (CLOCK_MONOTONIC).
+struct timespec sound_step_time;
+
+//! The bell settings to restore after sound_playing.
+XKeyboardState sound_saved_state;
+
+/*! \brief Returns the milliseconds until the given time (CLOCK_MONOTONIC).
  */
-void PlaySound(enum Sound snd) {
-  XKeyboardState state;
-  XKeyboardControl control;
-  struct timespec sleeptime;
+long MillisecondsUntil(const struct timespec *t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (t->tv_sec - now.tv_sec) * 1000L +
+         (t->tv_nsec - now.tv_nsec) / 1000000L;
+}
 
-  if (!auth_sounds) {
-    return;
-  }
+/*! \brief Sets a time the given number of microseconds from now.
+ *
+ * \param t The time to set (CLOCK_MONOTONIC).
+ * \param us How many microseconds from now it should be.
+ */
+void SetTimeFromNow(struct timespec *t, long us) {
+  clock_gettime(CLOCK_MONOTONIC, t);
+  t->tv_nsec += 1000L * us;
+  t->tv_sec += t->tv_nsec / 1000000000L;
+  t->tv_nsec %= 1000000000L;
+}
 
-  XGetKeyboardControl(display, &state);
+/*! \brief Schedules the next sound step SOUND_SLEEP_MS from now.
+ */
+void ScheduleSoundStep(int step) {
+  SetTimeFromNow(&sound_step_time, 1000L * SOUND_SLEEP_MS);
+  sound_step = step;
+}
+
+/*! \brief Plays the first note of the next queued sound.
+ */
+void StartNextSound(void) {
+  sound_playing = sound_queue[sound_queue_start];
+  sound_queue_start = (sound_queue_start + 1) % SOUND_QUEUE_SIZE;
+  --sound_queue_length;
+
+  XGetKeyboardControl(display, &sound_saved_state);
 
   // bell_percent changes note length on Linux, so let's use the middle value
   // to get a 1:1 mapping.
+  XKeyboardControl control;
   control.bell_percent = 50;
   control.bell_duration = SOUND_TONE_MS;
-  control.bell_pitch = sounds[snd][0];
+  control.bell_pitch = sounds[sound_playing][0];
   XChangeKeyboardControl(display, KBBellPercent | KBBellDuration | KBBellPitch,
                          &control);
   XBell(display, 0);
 
   XFlush(display);
 
-  sleeptime.tv_sec = SOUND_SLEEP_MS / 1000;
-  sleeptime.tv_nsec = 1000000L * (SOUND_SLEEP_MS % 1000);
-  nanosleep(&sleeptime, NULL);
+  ScheduleSoundStep(1);
+}
 
-  control.bell_pitch = sounds[snd][1];
-  XChangeKeyboardControl(display, KBBellPitch, &control);
-  XBell(display, 0);
+/*! \brief Performs the steps of sound playback that are due.
+ *
+ * Call this regularly from event loops.
+ */
+void UpdateSound(void) {
+  while (sound_step != 0 && MillisecondsUntil(&sound_step_time) <= 0) {
+    if (sound_step == 1) {
+      XKeyboardControl control;
+      control.bell_pitch = sounds[sound_playing][1];
+      XChangeKeyboardControl(display, KBBellPitch, &control);
+      XBell(display, 0);
+
+      control.bell_percent = sound_saved_state.bell_percent;
+      control.bell_duration = sound_saved_state.bell_duration;
+      control.bell_pitch = sound_saved_state.bell_pitch;
+      XChangeKeyboardControl(display,
+                             KBBellPercent | KBBellDuration | KBBellPitch,
+                             &control);
+
+      XFlush(display);
+
+      ScheduleSoundStep(2);
+    } else {
+      sound_step = 0;
+      if (sound_queue_length > 0) {
+        StartNextSound();
+      }
+    }
+  }
+}
 
-  control.bell_percent = state.bell_percent;
-  control.bell_duration = state.bell_duration;
-  control.bell_pitch = state.bell_pitch;
-  XChangeKeyboardControl(display, KBBellPercent | KBBellDuration | KBBellPitch,
-                         &control);
+/*! \brief Shortens a select() timeout to at most the given limit.
+ *
+ * \return True if the timeout was shortened.
+ */
+int LimitTimeout(struct timeval *timeout, const struct timeval *limit) {
+  if (limit->tv_sec > timeout->tv_sec ||
+      (limit->tv_sec == timeout->tv_sec &&
+       limit->tv_usec >= timeout->tv_usec)) {
+    return 0;
+  }
+  *timeout = *limit;
+  return 1;
+}
 
-  XFlush(display);
+/*! \brief Shortens a select() timeout to wake up at the given time.
+ *
+ * \param t The time to wake up at (CLOCK_MONOTONIC).
+ * \return True if the timeout was shortened.
+ */
+int LimitTimeoutUntil(struct timeval *timeout, const struct timespec *t) {
+  long ms = MillisecondsUntil(t);
+  if (ms < 0) {
+    ms = 0;
+  }
+  struct timeval limit;
+  limit.tv_sec = ms / 1000;
+  limit.tv_usec = (ms % 1000) * 1000;
+  return LimitTimeout(timeout, &limit);
+}
+
+/*! \brief Shortens a select() timeout to wake up for the next sound step.
+ *
+ * \return True if the timeout was shortened.
+ */
+int LimitTimeoutBySound(struct timeval *timeout) {
+  if (sound_step == 0) {
+    return 0;
+  }
+  return LimitTimeoutUntil(timeout, &sound_step_time);
+}
+
+/*! \brief Plays all queued sounds to the end, blocking.
+ */
+void FinishSound(void) {
+  while (sound_step != 0) {
+    long ms = MillisecondsUntil(&sound_step_time);
+    if (ms > 0) {
+      struct timespec sleeptime;
+      sleeptime.tv_sec = ms / 1000;
+      sleeptime.tv_nsec = 1000000L * (ms % 1000);
+      nanosleep(&sleeptime, NULL);
+    }
+    UpdateSound();
+  }
+}
+
+/*! \brief Play a sound sequence.
+ *
+ * This does not block; the sound is played by UpdateSound.
+ */
+void PlaySound(enum Sound snd) {
+  if (!auth_sounds) {
+    return;
+  }
 
-  nanosleep(&sleeptime, NULL);
+  if (sound_queue_length >= SOUND_QUEUE_SIZE) {
+    Log("Too many sounds queued; dropping one");
+    return;
+  }
+  sound_queue[(sound_queue_start + sound_queue_length) % SOUND_QUEUE_SIZE] =
+      snd;
+  ++sound_queue_length;
+  if (sound_step == 0) {
+    StartNextSound();
+  }
 }
 
 /*! \brief Switch to the next keyboard layout.
@@ -548,9 +694,10 @@ void CreateOrUpdatePerMonitorWindow(size_t i, const Monitor *monitor,
     windows[i] = main_window;
   } else {
     // Create a new window.
-    windows[i] =
-        XCreateWindow(display, parent_window, x, y, w, h, 0, CopyFromParent,
-                      InputOutput, CopyFromParent, CWBackPixel, &attrs);
+    attrs.event_mask = ExposureMask;
+    windows[i] = XCreateWindow(display, parent_window, x, y, w, h, 0,
+                               CopyFromParent, InputOutput, CopyFromParent,
+                               CWBackPixel | CWEventMask, &attrs);
     SetWMProperties(display, windows[i], "xsecurelock", "auth_x11_screen", argc,
                     argv);
     // We should always make sure that main_window stays on top of all others.
@@ -568,17 +715,17 @@ void CreateOrUpdatePerMonitorWindow(size_t i, const Monitor *monitor,
   gcattrs.function = GXcopy;
   gcattrs.foreground = xcolor_foreground.pixel;
   gcattrs.background = xcolor_background.pixel;
-  if (core_font != NULL) {
-    gcattrs.font = core_font->fid;
+  if (font.core_font != NULL) {
+    gcattrs.font = font.core_font->fid;
   }
   gcs[i] = XCreateGC(display, windows[i],
                      GCFunction | GCForeground | GCBackground |
-                         (core_font != NULL ? GCFont : 0),
+                         (font.core_font != NULL ? GCFont : 0),
                      &gcattrs);
   gcattrs.foreground = xcolor_warning.pixel;
   gcs_warning[i] = XCreateGC(display, windows[i],
                              GCFunction | GCForeground | GCBackground |
-                                 (core_font != NULL ? GCFont : 0),
+                                 (font.core_font != NULL ? GCFont : 0),
                              &gcattrs);
 #ifdef HAVE_XFT_EXT
   xft_draws[i] = XftDrawCreate(
@@ -644,78 +791,25 @@ void UpdatePerMonitorWindows(int monitors_changed, int region_w, int region_h,
   }
 }
 
-int TextAscent(void) {
-#ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
-    return xft_font->ascent;
-  }
-#endif
-  return core_font->max_bounds.ascent;
-}
-
-int TextDescent(void) {
-#ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
-    return xft_font->descent;
-  }
-#endif
-  return core_font->max_bounds.descent;
-}
-
-#ifdef HAVE_XFT_EXT
-// Returns the amount of pixels to expand the logical box in extents so it
-// covers the visible box.
-int XGlyphInfoExpandAmount(XGlyphInfo *extents) {
-  // Use whichever is larger - visible bounding box (bigger if font is italic)
-  // or spacing to next character (bigger if last character is a space).
-  // Best reference I could find:
-  //   https://keithp.com/~keithp/render/Xft.tutorial
-  // Visible bounding box: [-x, -x + width[
-  // Logical bounding box: [0, xOff[
-  // For centering we should always use the logical bounding box, however for
-  // erasing we should use the visible bounding box. Thus our goal is to
-  // expand the _logical_ box to fully cover the _visible_ box:
-  int expand_left = extents->x;
-  int expand_right = -extents->x + extents->width - extents->xOff;
-  int expand_max = expand_left > expand_right ? expand_left : expand_right;
-  int expand_positive = expand_max > 0 ? expand_max : 0;
-  return expand_positive;
-}
-#endif
-
 int TextWidth(const char *string, int len) {
-#ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
-    XGlyphInfo extents;
-    XftTextExtentsUtf8(display, xft_font, (const FcChar8 *)string, len,
-                       &extents);
-    return extents.xOff + 2 * XGlyphInfoExpandAmount(&extents);
-  }
-#endif
-  return XTextWidth(core_font, string, len);
+  // The box also covers glyphs drawn outside the logical box.
+  return TextAdvance(display, &font, string, len) +
+         2 * TextExpandAmount(display, &font, string, len);
 }
 
 void DrawString(int monitor, int x, int y, int is_warning, const char *string,
                 int len) {
+  struct TextPen pen;
+  pen.drawable = windows[monitor];
+  pen.gc = is_warning ? gcs_warning[monitor] : gcs[monitor];
 #ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
-    // HACK: Query text extents here to make the text fit into the specified
-    // box. For y this is covered by the usual ascent/descent behavior - for x
-    // we however do have to work around font descents being drawn to the left
-    // of the cursor.
-    XGlyphInfo extents;
-    XftTextExtentsUtf8(display, xft_font, (const FcChar8 *)string, len,
-                       &extents);
-    XftDrawStringUtf8(xft_draws[monitor],
-                      is_warning ? &xft_color_warning : &xft_color_foreground,
-                      xft_font, x + XGlyphInfoExpandAmount(&extents), y,
-                      (const FcChar8 *)string, len);
-    return;
-  }
+  pen.xft_draw = xft_draws[monitor];
+  pen.xft_color = is_warning ? &xft_color_warning : &xft_color_foreground;
 #endif
-  XDrawString(display, windows[monitor],
-              is_warning ? gcs_warning[monitor] : gcs[monitor], x, y, string,
-              len);
+  // Work around glyphs being drawn to the left of the logical box, so the
+  // text fits into the box TextWidth describes.
+  DrawText(display, &font, &pen,
+           x + TextExpandAmount(display, &font, string, len), y, string, len);
 }
 
 void StrAppend(char **output, size_t *output_size, const char *input,
@@ -770,8 +864,8 @@ void DisplayMessage(const char *title, const char *str, int is_warning) {
   char full_title[256];
   BuildTitle(full_title, sizeof(full_title), title);
 
-  int th = TextAscent() + TextDescent() + LINE_SPACING;
-  int to = TextAscent() + LINE_SPACING / 2;  // Text at to fits into 0 to th.
+  int th = TextAscent(&font) + TextDescent(&font) + LINE_SPACING;
+  int to = TextAscent(&font) + LINE_SPACING / 2;  // Text at to fits into 0 to th.
 
   int len_full_title = strlen(full_title);
   int tw_full_title = TextWidth(full_title, len_full_title);
@@ -910,16 +1004,104 @@ void DisplayMessage(const char *title, const char *str, int is_warning) {
   XFlush(display);
 }
 
-void WaitForKeypress(int seconds) {
-  // Sleep for up to 1 second _or_ a key press.
-  struct timeval timeout;
-  timeout.tv_sec = seconds;
-  timeout.tv_usec = 0;
-  fd_set set;
-  memset(&set, 0, sizeof(set));  // For clang-analyzer.
-  FD_ZERO(&set);
-  FD_SET(0, &set);
-  select(1, &set, NULL, NULL, &timeout);
+/*! \brief Waits for input on a file descriptor, keeping the display live.
+ *
+ * Meanwhile, X11 events are handled, sounds are played and the clock is kept
+ * up to date.
+ *
+ * \param fd The file descriptor to wait for.
+ * \param timeout_ms The maximum time to wait, or -1 to wait indefinitely.
+ * \param title The title of the message to redraw as needed, or NULL to not
+ *   redraw.
+ * \param str The message to redraw.
+ * \param is_warning Whether to use the warning style to redraw the message.
+ * \return 1 if fd is readable, 0 on timeout, -1 on error.
+ */
+int WaitForInput(int fd, long timeout_ms, const char *title, const char *str,
+                 int is_warning) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += 1000000L * (timeout_ms % 1000);
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+  int x11_fd = ConnectionNumber(display);
+  time_t drawn_at = time(NULL);
+  for (;;) {
+    int redraw = 0;
+    XEvent ev;
+    while (XPending(display) && (XNextEvent(display, &ev), 1)) {
+      if (ev.type == Expose) {
+        redraw = 1;
+      } else if (IsMonitorChangeEvent(display, &ev)) {
+        NoteMonitorChange();
+      }
+    }
+    if (MonitorChangeSettled(NULL)) {
+      per_monitor_windows_dirty = 1;
+      redraw = 1;
+    }
+    if (show_datetime && time(NULL) != drawn_at) {
+      redraw = 1;
+    }
+    if (redraw && title != NULL) {
+      DisplayMessage(title, str, is_warning);
+      drawn_at = time(NULL);
+    }
+    UpdateSound();
+
+    struct timeval timeout;
+    timeout.tv_sec = 86400;
+    timeout.tv_usec = 0;
+    if (timeout_ms >= 0) {
+      long ms = MillisecondsUntil(&deadline);
+      if (ms <= 0) {
+        return 0;
+      }
+      timeout.tv_sec = ms / 1000;
+      timeout.tv_usec = (ms % 1000) * 1000;
+    }
+    if (show_datetime && title != NULL) {
+      // Wake up when the next second starts.
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      if (timeout.tv_sec > 0 || timeout.tv_usec > 1000000 - now.tv_usec) {
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 1000000 - now.tv_usec;
+      }
+    }
+    LimitTimeoutBySound(&timeout);
+
+    fd_set set;
+    memset(&set, 0, sizeof(set));  // For clang-analyzer.
+    FD_ZERO(&set);
+    FD_SET(fd, &set);
+    FD_SET(x11_fd, &set);
+    XFlush(display);
+    FlushLog();
+    int nfds = select((fd > x11_fd ? fd : x11_fd) + 1, &set, NULL, NULL,
+                      &timeout);
+    if (nfds < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LogErrno("select");
+      return -1;
+    }
+    if (nfds > 0 && FD_ISSET(fd, &set)) {
+      return 1;
+    }
+  }
+}
+
+/*! \brief Clears and frees a message from the authproto helper.
+ */
+void FreeMessage(char **message) {
+  if (*message != NULL) {
+    explicit_bzero(*message, strlen(*message));
+    free(*message);
+    *message = NULL;
+  }
 }
 
 /*! \brief Bump the position for the password "cursor".
@@ -993,13 +1175,14 @@ int Prompt(const char *msg, char **response, int echo) {
     int len;
   } priv;
   int blink_state = 0;
+  int x11_fd = ConnectionNumber(display);
 
   if (!echo && MLOCK_PAGE(&priv, sizeof(priv)) < 0) {
     LogErrno("mlock");
     // We continue anyway, as the user being unable to unlock the screen is
     // worse. But let's alert the user.
     DisplayMessage("Error", "Password will not be stored securely.", 1);
-    WaitForKeypress(1);
+    WaitForInput(0, 1000, "Error", "Password will not be stored securely.", 1);
   }
 
   priv.pwlen = 0;
@@ -1013,6 +1196,10 @@ int Prompt(const char *msg, char **response, int echo) {
   int status = 0;
   int done = 0;
   int played_sound = 0;
+  // When the cursor blinks next (CLOCK_MONOTONIC). Due right away, so the
+  // cursor starts out visible and blinks from there.
+  struct timespec next_blink;
+  SetTimeFromNow(&next_blink, 0);
 
   while (!done) {
     if (echo) {
@@ -1103,19 +1290,58 @@ int Prompt(const char *msg, char **response, int echo) {
       played_sound = 1;
     }
 
-    // Blink the cursor.
-    blink_state = !blink_state;
+    // Blink the cursor, but only on its own schedule; redraws for X11 events
+    // in between leave it alone.
+    if (MillisecondsUntil(&next_blink) <= 0) {
+      blink_state = !blink_state;
+      SetTimeFromNow(&next_blink, BLINK_INTERVAL);
+    }
 
-    struct timeval timeout;
-    timeout.tv_sec = BLINK_INTERVAL / 1000000;
-    timeout.tv_usec = BLINK_INTERVAL % 1000000;
+    // When to redraw for X11 events, if redraw is set.
+    int redraw = 0;
+    struct timespec redraw_time;
 
     while (!done) {
+      // Handle X11 events right away.
+      int saw_event = 0;
+      while (XPending(display) && (XNextEvent(display, &priv.ev), 1)) {
+        if (priv.ev.type == Expose) {
+          saw_event = 1;
+        } else if (IsMonitorChangeEvent(display, &priv.ev)) {
+          NoteMonitorChange();
+        }
+      }
+      struct timeval settle_timeout;
+      if (MonitorChangeSettled(&settle_timeout)) {
+        per_monitor_windows_dirty = 1;
+        saw_event = 1;
+      }
+      if (saw_event && !redraw) {
+        // Redraw soon, but coalesce events arriving meanwhile.
+        redraw = 1;
+        SetTimeFromNow(&redraw_time, EVENT_REDRAW_DELAY);
+      }
+
       fd_set set;
       memset(&set, 0, sizeof(set));  // For clang-analyzer.
       FD_ZERO(&set);
       FD_SET(0, &set);
-      int nfds = select(1, &set, NULL, NULL, &timeout);
+      FD_SET(x11_fd, &set);
+      FlushLog();
+      // Wake up for the next blink, redraw, sound step or monitor change.
+      struct timeval timeout;
+      timeout.tv_sec = BLINK_INTERVAL / 1000000;
+      timeout.tv_usec = BLINK_INTERVAL % 1000000;
+      LimitTimeoutUntil(&timeout, &next_blink);
+      if (redraw) {
+        LimitTimeoutUntil(&timeout, &redraw_time);
+      }
+      LimitTimeoutBySound(&timeout);
+      if (MonitorChangePending()) {
+        LimitTimeout(&timeout, &settle_timeout);
+      }
+      int nfds = select(x11_fd + 1, &set, NULL, NULL, &timeout);
+      UpdateSound();
       if (nfds < 0) {
         LogErrno("select");
         done = 1;
@@ -1132,12 +1358,21 @@ int Prompt(const char *msg, char **response, int echo) {
         deadline = now + prompt_timeout;
       }
       if (nfds == 0) {
-        // Blink...
-        break;
+        if (MillisecondsUntil(&next_blink) <= 0 ||
+            (redraw && MillisecondsUntil(&redraw_time) <= 0)) {
+          // Blink or redraw...
+          break;
+        }
+        continue;
+      }
+      if (!FD_ISSET(0, &set)) {
+        // Only X11 events; handled at the top of the loop.
+        continue;
       }
 
       // From now on, only do nonblocking selects so we update the screen ASAP.
-      timeout.tv_usec = 0;
+      // The cursor then blinks right after that update.
+      SetTimeFromNow(&next_blink, 0);
 
       // Force the cursor to be in visible state while typing.
       blink_state = 0;
@@ -1206,7 +1441,8 @@ int Prompt(const char *msg, char **response, int echo) {
             // is worse. But let's alert the user of this.
             DisplayMessage("Error", "Password has not been stored securely.",
                            1);
-            WaitForKeypress(1);
+            WaitForInput(0, 1000, "Error",
+                         "Password has not been stored securely.", 1);
           }
           if (priv.pwlen != 0) {
             memcpy(*response, priv.pwbuf, priv.pwlen);
@@ -1234,13 +1470,6 @@ int Prompt(const char *msg, char **response, int echo) {
           break;
       }
     }
-
-    // Handle X11 events that queued up.
-    while (!done && XPending(display) && (XNextEvent(display, &priv.ev), 1)) {
-      if (IsMonitorChangeEvent(display, priv.ev.type)) {
-        per_monitor_windows_dirty = 1;
-      }
-    }
   }
 
   // priv contains password related data, so better clear it.
@@ -1288,17 +1517,20 @@ int Authenticate() {
       int requestfd1 = dup(requestfd[1]);
       if (requestfd1 == -1) {
         LogErrno("dup");
+        FinishLog();
         _exit(EXIT_FAILURE);
       }
       close(requestfd[1]);
       if (dup2(responsefd[0], 0) == -1) {
         LogErrno("dup2");
+        FinishLog();
         _exit(EXIT_FAILURE);
       }
       close(responsefd[0]);
       if (requestfd1 != 1) {
         if (dup2(requestfd1, 1) == -1) {
           LogErrno("dup2");
+          FinishLog();
           _exit(EXIT_FAILURE);
         }
         close(requestfd1);
@@ -1307,6 +1539,7 @@ int Authenticate() {
       if (responsefd[0] != 0) {
         if (dup2(responsefd[0], 0) == -1) {
           LogErrno("dup2");
+          FinishLog();
           _exit(EXIT_FAILURE);
         }
         close(responsefd[0]);
@@ -1314,6 +1547,7 @@ int Authenticate() {
       if (requestfd[1] != 1) {
         if (dup2(requestfd[1], 1) == -1) {
           LogErrno("dup2");
+          FinishLog();
           _exit(EXIT_FAILURE);
         }
         close(requestfd[1]);
@@ -1323,30 +1557,41 @@ int Authenticate() {
     execl(authproto_executable, authproto_executable, NULL);
     LogErrno("execl");
     sleep(2);  // Reduce log spam or other effects from failed execl.
+    FinishLog();
     _exit(EXIT_FAILURE);
   }
 
   // Otherwise, we're in the parent process.
   close(requestfd[1]);
   close(responsefd[0]);
+  // What is on the screen, so it can be redrawn while waiting.
+  const char *shown_title = NULL;
+  char *shown_message = NULL;
+  int shown_is_warning = 0;
   for (;;) {
     char *message;
     char *response;
+    // Keep the display live while the authproto helper works.
+    WaitForInput(requestfd[0], -1, shown_title,
+                 shown_message != NULL ? shown_message : "", shown_is_warning);
     char type = ReadPacket(requestfd[0], &message, 1);
+    FreeMessage(&shown_message);
     switch (type) {
       case PTYPE_INFO_MESSAGE:
         DisplayMessage("PAM says", message, 0);
-        explicit_bzero(message, strlen(message));
-        free(message);
         PlaySound(SOUND_INFO);
-        WaitForKeypress(1);
+        WaitForInput(0, 1000, "PAM says", message, 0);
+        shown_title = "PAM says";
+        shown_message = message;
+        shown_is_warning = 0;
         break;
       case PTYPE_ERROR_MESSAGE:
         DisplayMessage("Error", message, 1);
-        explicit_bzero(message, strlen(message));
-        free(message);
         PlaySound(SOUND_ERROR);
-        WaitForKeypress(1);
+        WaitForInput(0, 1000, "Error", message, 1);
+        shown_title = "Error";
+        shown_message = message;
+        shown_is_warning = 1;
         break;
       case PTYPE_PROMPT_LIKE_USERNAME:
         if (Prompt(message, &response, 1)) {
@@ -1359,6 +1604,8 @@ int Authenticate() {
         explicit_bzero(message, strlen(message));
         free(message);
         DisplayMessage("Processing...", "", 0);
+        shown_title = "Processing...";
+        shown_is_warning = 0;
         break;
       case PTYPE_PROMPT_LIKE_PASSWORD:
         if (Prompt(message, &response, 0)) {
@@ -1371,6 +1618,8 @@ int Authenticate() {
         explicit_bzero(message, strlen(message));
         free(message);
         DisplayMessage("Processing...", "", 0);
+        shown_title = "Processing...";
+        shown_is_warning = 0;
         break;
       case 0:
         goto done;
@@ -1382,6 +1631,7 @@ int Authenticate() {
     }
   }
 done:
+  FreeMessage(&shown_message);
   close(requestfd[0]);
   close(responsefd[1]);
   int status;
@@ -1509,61 +1759,25 @@ int main(int argc_local, char **argv_local) {
 
   Colormap colormap = DefaultColormap(display, DefaultScreen(display));
 
-  XColor dummy;
-  XAllocNamedColor(
-      display, DefaultColormap(display, DefaultScreen(display)),
-      GetStringSetting("XSECURELOCK_AUTH_BACKGROUND_COLOR", "black"),
-      &xcolor_background, &dummy);
-  XAllocNamedColor(
-      display, DefaultColormap(display, DefaultScreen(display)),
-      GetStringSetting("XSECURELOCK_AUTH_FOREGROUND_COLOR", "white"),
-      &xcolor_foreground, &dummy);
-  XAllocNamedColor(display, DefaultColormap(display, DefaultScreen(display)),
-                   GetStringSetting("XSECURELOCK_AUTH_WARNING_COLOR", "red"),
-                   &xcolor_warning, &dummy);
-
-  core_font = NULL;
-#ifdef HAVE_XFT_EXT
-  xft_font = NULL;
-#endif
-
-  const char *font_name = GetStringSetting("XSECURELOCK_FONT", "");
-
-  // First try parsing the font name as an X11 core font. We're trying these
-  // first as their font name format is more restrictive (usually starts with a
-  // dash), except for when font aliases are used.
-  int have_font = 0;
-  if (font_name[0] != 0) {
-    core_font = XLoadQueryFont(display, font_name);
-    have_font = (core_font != NULL);
-#ifdef HAVE_XFT_EXT
-    if (!have_font) {
-      xft_font = XftFontOpenName(display, DefaultScreen(display), font_name);
-      have_font = (xft_font != NULL);
-    }
-#endif
-  }
-  if (!have_font) {
-    if (font_name[0] != 0) {
-      Log("Could not load the specified font %s - trying a default font",
-          font_name);
-    }
-#ifdef HAVE_XFT_EXT
-    xft_font = XftFontOpenName(display, DefaultScreen(display), "monospace");
-    have_font = (xft_font != NULL);
-#endif
-    if (!have_font) {
-      core_font = XLoadQueryFont(display, "fixed");
-      have_font = (core_font != NULL);
-    }
+  // Colors from the snapshot are owned by xsecurelock; don't free them.
+  const struct SessionSnapshot *snapshot = GetSessionSnapshot();
+  int own_colors = (snapshot == NULL || !snapshot->have_auth_colors);
+  if (own_colors) {
+    AllocAuthColors(display, &xcolor_background, &xcolor_foreground,
+                    &xcolor_warning);
+  } else {
+    xcolor_background = snapshot->auth_background;
+    xcolor_foreground = snapshot->auth_foreground;
+    xcolor_warning = snapshot->auth_warning;
   }
-  if (!have_font) {
-    Log("Could not load a mind-bogglingly stupid font");
+
+  if (!LoadFont(display, GetStringSetting("XSECURELOCK_FONT", ""), 0,
+                &font)) {
     return 1;
   }
 
 #ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
+  if (font.xft_font != NULL) {
     XRenderColor xrcolor;
     xrcolor.alpha = 65535;
 
@@ -1584,6 +1798,8 @@ int main(int argc_local, char **argv_local) {
   }
 #endif
 
+  // Redraw when uncovered. SelectMonitorChangeEvents adds to this.
+  XSelectInput(display, main_window, ExposureMask);
   SelectMonitorChangeEvents(display, main_window);
 
   InitWaitPgrp();
@@ -1593,21 +1809,26 @@ int main(int argc_local, char **argv_local) {
   // Clear any possible processing message by closing our windows.
   DestroyPerMonitorWindows(0);
 
+  // Let the last sound play, and restore the bell settings.
+  FinishSound();
+
 #ifdef HAVE_XFT_EXT
-  if (xft_font != NULL) {
+  if (font.xft_font != NULL) {
     XftColorFree(display, DefaultVisual(display, DefaultScreen(display)),
                  DefaultColormap(display, DefaultScreen(display)),
                  &xft_color_warning);
     XftColorFree(display, DefaultVisual(display, DefaultScreen(display)),
                  DefaultColormap(display, DefaultScreen(display)),
                  &xft_color_foreground);
-    XftFontClose(display, xft_font);
   }
 #endif
+  FreeFont(display, &font);
 
-  XFreeColors(display, colormap, &xcolor_warning.pixel, 1, 0);
-  XFreeColors(display, colormap, &xcolor_foreground.pixel, 1, 0);
-  XFreeColors(display, colormap, &xcolor_background.pixel, 1, 0);
+  if (own_colors) {
+    XFreeColors(display, colormap, &xcolor_warning.pixel, 1, 0);
+    XFreeColors(display, colormap, &xcolor_foreground.pixel, 1, 0);
+    XFreeColors(display, colormap, &xcolor_background.pixel, 1, 0);
+  }
 
   return status;
 }
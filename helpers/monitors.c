@@ -16,9 +16,11 @@ limitations under the License.
 
 #include "monitors.h"
 
-#include <X11/Xlib.h>  // for XWindowAttributes, Display, XGetW...
-#include <stdlib.h>    // for qsort
-#include <string.h>    // for memcmp, memset
+#include <X11/Xatom.h>  // for XA_INTEGER
+#include <X11/Xlib.h>   // for XWindowAttributes, Display, XGetW...
+#include <stdlib.h>     // for qsort
+#include <string.h>     // for memcmp, memcpy, memset
+#include <time.h>       // for clock_gettime, timespec, CLOCK_MONOTONIC
 
 #ifdef HAVE_XRANDR_EXT
 #include <X11/extensions/Xrandr.h>  // for XRRMonitorInfo, XRRCrtcInfo, XRRO...
@@ -31,9 +33,22 @@ limitations under the License.
 #include "../env_settings.h"  // for GetIntSetting
 #include "../logging.h"       // for Log
 
+//! The property in which xsecurelock publishes the monitor configuration.
+#define MONITORS_PROPERTY "_XSECURELOCK_MONITORS"
+
+//! The format version of MONITORS_PROPERTY; it is the first value.
+#define MONITORS_PROPERTY_VERSION 1
+
+//! The maximum number of monitors that are published.
+#define MAX_PUBLISHED_MONITORS 16
+
+//! Whether GetMonitors found a monitor configuration published by xsecurelock.
+static int using_published_monitors = 0;
+
 #ifdef HAVE_XRANDR_EXT
 static Display* initialized_for = NULL;
 static int have_xrandr12_ext;
+static int have_xrandr13_ext;
 #ifdef HAVE_XRANDR15_EXT
 static int have_xrandr15_ext;
 #endif
@@ -46,6 +61,7 @@ static int MaybeInitXRandR(Display* dpy) {
   }
 
   have_xrandr12_ext = 0;
+  have_xrandr13_ext = 0;
 #ifdef HAVE_XRANDR15_EXT
   have_xrandr15_ext = 0;
 #endif
@@ -59,6 +75,9 @@ static int MaybeInitXRandR(Display* dpy) {
           have_xrandr12_ext = 1;
         }
       }
+      if (major > 1 || (major == 1 && minor >= 3)) {
+        have_xrandr13_ext = 1;
+      }
 #ifdef HAVE_XRANDR15_EXT
       if (major > 1 || (major == 1 && minor >= 5)) {
         if (!GetIntSetting("XSECURELOCK_NO_XRANDR15", 0)) {
@@ -135,36 +154,32 @@ static void AddMonitor(Monitor* out_monitors, size_t* num_monitors,
 static int GetMonitorsXRandR12(Display* dpy, Window window, int wx, int wy,
                                int ww, int wh, Monitor* out_monitors,
                                size_t* out_num_monitors, size_t max_monitors) {
-  XRRScreenResources* screenres = XRRGetScreenResources(dpy, window);
+  // XRRGetScreenResources makes the X server probe all outputs, which can
+  // take hundreds of milliseconds (EDID reads). We only care about the current
+  // configuration anyway.
+  XRRScreenResources* screenres =
+      have_xrandr13_ext ? XRRGetScreenResourcesCurrent(dpy, window)
+                        : XRRGetScreenResources(dpy, window);
   if (screenres == NULL) {
     return 0;
   }
+  // Every enabled Crtc shows a part of the screen on at least one connected
+  // output, so there is no need to query the outputs themselves. Cloned
+  // screens have multiple Crtcs at the same position; AddMonitor skips those.
   int i;
-  for (i = 0; i < screenres->noutput; ++i) {
-    XRROutputInfo* output =
-        XRRGetOutputInfo(dpy, screenres, screenres->outputs[i]);
-    if (output == NULL) {
+  for (i = 0; i < screenres->ncrtc; ++i) {
+    XRRCrtcInfo* info = XRRGetCrtcInfo(dpy, screenres, screenres->crtcs[i]);
+    if (info == NULL) {
       continue;
     }
-    if (output->connection == RR_Connected) {
-      // NOTE: If an output has multiple Crtcs (i.e. if the screen is
-      // cloned), we only look at the first. Let's assume that the center
-      // of that one should always be onscreen anyway (even though they
-      // may not be, as cloned displays can have different panning
-      // settings).
-      RRCrtc crtc =
-          (output->crtc ? output->crtc : output->ncrtc ? output->crtcs[0] : 0);
-      XRRCrtcInfo* info = (crtc ? XRRGetCrtcInfo(dpy, screenres, crtc) : 0);
-      if (info != NULL) {
-        int x = CLAMP(info->x, wx, wx + ww) - wx;
-        int y = CLAMP(info->y, wy, wy + wh) - wy;
-        int w = CLAMP(info->x + (int)info->width, wx + x, wx + ww) - (wx + x);
-        int h = CLAMP(info->y + (int)info->height, wy + y, wy + wh) - (wy + y);
-        AddMonitor(out_monitors, out_num_monitors, max_monitors, x, y, w, h);
-        XRRFreeCrtcInfo(info);
-      }
+    if (info->mode != None && info->noutput > 0) {
+      int x = CLAMP(info->x, wx, wx + ww) - wx;
+      int y = CLAMP(info->y, wy, wy + wh) - wy;
+      int w = CLAMP(info->x + (int)info->width, wx + x, wx + ww) - (wx + x);
+      int h = CLAMP(info->y + (int)info->height, wy + y, wy + wh) - (wy + y);
+      AddMonitor(out_monitors, out_num_monitors, max_monitors, x, y, w, h);
     }
-    XRRFreeOutputInfo(output);
+    XRRFreeCrtcInfo(info);
   }
   XRRFreeScreenResources(screenres);
   return *out_num_monitors != 0;
@@ -244,19 +259,77 @@ static void GetMonitorsGuess(const XWindowAttributes* xwa,
   }
 }
 
-size_t GetMonitors(Display* dpy, Window window, Monitor* out_monitors,
-                   size_t max_monitors) {
+static Atom GetMonitorsAtom(Display* dpy) {
+  static Display* atom_for = NULL;
+  static Atom atom = None;
+  if (dpy != atom_for) {
+    atom = XInternAtom(dpy, MONITORS_PROPERTY, False);
+    atom_for = dpy;
+  }
+  return atom;
+}
+
+static int GetMonitorsPublished(Display* dpy, Window window,
+                                const XWindowAttributes* xwa,
+                                Monitor* out_monitors,
+                                size_t* out_num_monitors,
+                                size_t max_monitors) {
+  Atom type;
+  int format;
+  unsigned long nitems, bytes_after;
+  unsigned char* data = NULL;
+  if (XGetWindowProperty(dpy, window, GetMonitorsAtom(dpy), 0,
+                         2 + 4 * (long)max_monitors, False, XA_INTEGER, &type,
+                         &format, &nitems, &bytes_after, &data) != Success) {
+    return 0;
+  }
+  int found = 0;
+  if (type == XA_INTEGER && format == 32 && nitems >= 2) {
+    // Format 32 properties are returned as longs by Xlib.
+    const long* values = (const long*)data;
+    if (values[0] == MONITORS_PROPERTY_VERSION) {
+      unsigned long i;
+      for (i = 0; i < (unsigned long)values[1] && 2 + 4 * i + 3 < nitems;
+           ++i) {
+        const long* m = values + 2 + 4 * i;
+        // Like the XRandR results, clip to the window as it is now; the
+        // property may be outdated or come from anyone.
+        long long x = CLAMP((long long)m[0], 0, xwa->width);
+        long long y = CLAMP((long long)m[1], 0, xwa->height);
+        long long w = CLAMP((long long)m[0] + m[2], x, xwa->width) - x;
+        long long h = CLAMP((long long)m[1] + m[3], y, xwa->height) - y;
+        AddMonitor(out_monitors, out_num_monitors, max_monitors, x, y, w, h);
+      }
+      found = 1;
+    }
+  }
+  if (data != NULL) {
+    XFree(data);
+  }
+  return found;
+}
+
+static size_t QueryMonitors(Display* dpy, Window window, Monitor* out_monitors,
+                            size_t max_monitors, int use_published) {
   if (max_monitors < 1) {
     return 0;
   }
 
   size_t num_monitors = 0;
 
-  // As outputs will be relative to the window, we have to query its attributes.
+  // As outputs will be relative to the window, we have to query its
+  // attributes.
   XWindowAttributes xwa;
   XGetWindowAttributes(dpy, window, &xwa);
 
   do {
+    if (use_published &&
+        GetMonitorsPublished(dpy, window, &xwa, out_monitors, &num_monitors,
+                             max_monitors)) {
+      using_published_monitors = 1;
+      break;
+    }
+
 #ifdef HAVE_XRANDR_EXT
     if (GetMonitorsXRandR(dpy, window, &xwa, out_monitors, &num_monitors,
                           max_monitors)) {
@@ -278,23 +351,88 @@ size_t GetMonitors(Display* dpy, Window window, Monitor* out_monitors,
   return num_monitors;
 }
 
+size_t GetMonitors(Display* dpy, Window window, Monitor* out_monitors,
+                   size_t max_monitors) {
+  return QueryMonitors(dpy, window, out_monitors, max_monitors, 1);
+}
+
+void PublishMonitors(Display* dpy, const Window* windows, size_t num_windows) {
+  static Monitor published[MAX_PUBLISHED_MONITORS];
+  static size_t num_published = (size_t)-1;
+
+  if (num_windows < 1) {
+    return;
+  }
+  Monitor monitors[MAX_PUBLISHED_MONITORS];
+  size_t num_monitors = QueryMonitors(dpy, windows[0], monitors,
+                                      MAX_PUBLISHED_MONITORS, 0);
+  if (num_monitors == num_published &&
+      !memcmp(monitors, published, sizeof(monitors))) {
+    // Unchanged; don't wake up the helpers.
+    return;
+  }
+  memcpy(published, monitors, sizeof(published));
+  num_published = num_monitors;
+
+  long data[2 + 4 * MAX_PUBLISHED_MONITORS];
+  data[0] = MONITORS_PROPERTY_VERSION;
+  data[1] = (long)num_monitors;
+  size_t i;
+  for (i = 0; i < num_monitors; ++i) {
+    data[2 + 4 * i] = monitors[i].x;
+    data[2 + 4 * i + 1] = monitors[i].y;
+    data[2 + 4 * i + 2] = monitors[i].width;
+    data[2 + 4 * i + 3] = monitors[i].height;
+  }
+  for (i = 0; i < num_windows; ++i) {
+    XChangeProperty(dpy, windows[i], GetMonitorsAtom(dpy), XA_INTEGER, 32,
+                    PropModeReplace, (const unsigned char*)data,
+                    2 + 4 * (int)num_monitors);
+  }
+}
+
 void SelectMonitorChangeEvents(Display* dpy, Window window) {
+  // If xsecurelock published the monitor configuration on this window, watch
+  // it for changes; XRandR events are then ignored.
+  Atom type;
+  int format;
+  unsigned long nitems, bytes_after;
+  unsigned char* data = NULL;
+  if (XGetWindowProperty(dpy, window, GetMonitorsAtom(dpy), 0, 0, False,
+                         XA_INTEGER, &type, &format, &nitems, &bytes_after,
+                         &data) == Success) {
+    if (data != NULL) {
+      XFree(data);
+    }
+    if (type == XA_INTEGER) {
+      XWindowAttributes xwa;
+      XGetWindowAttributes(dpy, window, &xwa);
+      XSelectInput(dpy, window, xwa.your_event_mask | PropertyChangeMask);
+    }
+  }
+
 #ifdef HAVE_XRANDR_EXT
   if (MaybeInitXRandR(dpy)) {
     XRRSelectInput(dpy, window,
                    RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask |
                        RROutputChangeNotifyMask);
   }
-#else
-  (void)dpy;
-  (void)window;
 #endif
 }
 
-int IsMonitorChangeEvent(Display* dpy, int type) {
+int IsMonitorChangeEvent(Display* dpy, const XEvent* ev) {
+  if (ev->type == PropertyNotify) {
+    return using_published_monitors &&
+           ev->xproperty.atom == GetMonitorsAtom(dpy);
+  }
+  if (using_published_monitors) {
+    // xsecurelock will publish the new configuration when done.
+    return 0;
+  }
+
 #ifdef HAVE_XRANDR_EXT
   if (MaybeInitXRandR(dpy)) {
-    switch (type - event_base) {
+    switch (ev->type - event_base) {
       case RRScreenChangeNotify:
       case RRNotify + RRNotify_CrtcChange:
       case RRNotify + RRNotify_OutputChange:
@@ -303,11 +441,61 @@ int IsMonitorChangeEvent(Display* dpy, int type) {
         return 0;
     }
   }
-#else
-  (void)dpy;
-  (void)type;
 #endif
 
   // XRandR-less dummy fallback.
   return 0;
 }
+
+//! Whether monitor changes have been noted but not handled yet.
+static int change_pending = 0;
+
+//! The number of monitor change events since the last handled change.
+static int change_count = 0;
+
+//! When the last monitor change was noted (CLOCK_MONOTONIC).
+static struct timespec last_change;
+
+static long GetSettleTimeMs(void) {
+  static long settle_ms = -1;
+  if (settle_ms < 0) {
+    settle_ms = GetIntSetting("XSECURELOCK_MONITOR_SETTLE_MS", 200);
+    if (settle_ms < 0) {
+      settle_ms = 0;
+    }
+  }
+  return settle_ms;
+}
+
+void NoteMonitorChange(void) {
+  change_pending = 1;
+  ++change_count;
+  clock_gettime(CLOCK_MONOTONIC, &last_change);
+}
+
+int MonitorChangePending(void) { return change_pending; }
+
+int MonitorChangeSettled(struct timeval* remaining) {
+  if (!change_pending) {
+    return 0;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long elapsed_ms = (now.tv_sec - last_change.tv_sec) * 1000L +
+                    (now.tv_nsec - last_change.tv_nsec) / 1000000L;
+  // xsecurelock only publishes settled monitor configurations.
+  long settle_ms = using_published_monitors ? 0 : GetSettleTimeMs();
+  if (elapsed_ms < settle_ms) {
+    if (remaining != NULL) {
+      remaining->tv_sec = (settle_ms - elapsed_ms) / 1000;
+      remaining->tv_usec = (settle_ms - elapsed_ms) % 1000 * 1000;
+    }
+    return 0;
+  }
+  if (change_count > 1) {
+    Log("Coalesced %d monitor change events", change_count);
+  }
+  change_pending = 0;
+  change_count = 0;
+  return 1;
+}
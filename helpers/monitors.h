@@ -20,12 +20,16 @@ limitations under the License.
 #include <X11/X.h>     // for Window
 #include <X11/Xlib.h>  // for Display
 #include <stddef.h>    // for size_t
+#include <sys/time.h>  // for timeval
 
 typedef struct {
   int x, y, width, height;
 } Monitor;
 
 /*! \brief Queries the current monitor configuration.
+ *
+ * If xsecurelock published the monitor configuration on the window (see
+ * PublishMonitors), that is used instead of asking XRandR.
  *
  * Note: out_monitors will be zero padded and sorted in some deterministic order
  * so memcmp can be used to check if the monitor configuration has actually
@@ -41,19 +45,58 @@ typedef struct {
 size_t GetMonitors(Display* dpy, Window window, Monitor* out_monitors,
                    size_t max_monitors);
 
+/*! \brief Publishes the current monitor configuration on the given windows.
+ *
+ * Helpers calling GetMonitors on one of these windows then use this instead of
+ * querying XRandR themselves, so all processes agree on the layout. Nothing is
+ * written if the configuration did not change since the last call.
+ *
+ * \param dpy The current display.
+ * \param windows The windows to publish on; they must all have the same
+ *   position and size. Coordinates are relative to these windows.
+ * \param num_windows The number of windows.
+ */
+void PublishMonitors(Display* dpy, const Window* windows, size_t num_windows);
+
 /*! \brief Enable receiving monitor change events for the given display at w.
+ *
+ * Call this before GetMonitors.
  */
 void SelectMonitorChangeEvents(Display* dpy, Window window);
 
-/*! \brief Returns the event type that indicates a change to the monitor
+/*! \brief Returns whether an event indicates a change to the monitor
  *    configuration.
  *
  * \param dpy The current display.
- * \param type The received event type.
+ * \param ev The received event.
  *
  * \returns 1 if the received event is a monitor change event and GetMonitors
  *   should be called, or 0 otherwise.
  */
-int IsMonitorChangeEvent(Display* dpy, int type);
+int IsMonitorChangeEvent(Display* dpy, const XEvent* ev);
+
+/*! \brief Records that a monitor change event has been received.
+ *
+ * Monitor changes tend to come in bursts (e.g. when docking). Rather than
+ * calling GetMonitors on every event, call this, and call GetMonitors once
+ * MonitorChangeSettled returns true.
+ */
+void NoteMonitorChange(void);
+
+/*! \brief Returns whether a monitor change is pending but has not settled yet.
+ */
+int MonitorChangePending(void);
+
+/*! \brief Checks whether noted monitor changes have settled.
+ *
+ * Monitor changes have settled once no further change has been noted for
+ * XSECURELOCK_MONITOR_SETTLE_MS milliseconds.
+ *
+ * \param remaining If still pending, receives the time until the changes will
+ *   have settled; may be NULL.
+ * \return 1 if changes have settled and GetMonitors should be called now, 0
+ *   otherwise.
+ */
+int MonitorChangeSettled(struct timeval* remaining);
 
 #endif
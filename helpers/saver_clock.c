@@ -0,0 +1,387 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*!
+ *\brief Clock saver.
+ *
+ *Shows the time and date on each monitor, in the font of auth_x11. It only
+ *wakes up once a second, and then only redraws the characters that changed.
+ *
+ *Usage: XSCREENSAVER_WINDOW=window_id ./saver_clock
+ */
+
+#include <X11/X.h>       // for Window, Expose, ConfigureNotify
+#include <X11/Xlib.h>    // for XClearArea, XSetFont, XNextEvent, XPending
+#include <errno.h>       // for errno, EINTR
+#include <locale.h>      // for setlocale, LC_CTYPE, LC_TIME
+#include <signal.h>      // for sigaction, sigemptyset, SIGUSR1, SIG_IGN
+#include <stdlib.h>      // for rand, srand
+#include <string.h>      // for memcmp, memcpy
+#include <sys/select.h>  // for select, FD_SET, FD_ZERO, fd_set
+#include <time.h>        // for clock_gettime, localtime_r, strftime
+#include <unistd.h>      // for execl, fork, getpid
+
+#ifdef HAVE_XFT_EXT
+#include <X11/Xft/Xft.h>             // for XftColor, XftDraw, XftDrawCreate
+#include <X11/extensions/Xrender.h>  // for XRenderColor
+#endif
+
+#include "../env_settings.h"      // for GetIntSetting, GetStringSetting
+#include "../logging.h"           // for Log, LogErrno, FlushLog
+#include "../xscreensaver_api.h"  // for ReadWindowID
+#include "monitors.h"             // for GetMonitors, IsMonitorChangeEvent
+#include "text.h"                 // for DrawText, LoadFont, TextAdvance
+
+#define MAX_MONITORS 16
+
+//! The number of text lines: time and date.
+#define NUM_LINES 2
+
+//! Extra spacing between the lines, in pixels.
+#define LINE_SPACING 4
+
+//! The font size in relation to the smallest monitor height.
+#define FONT_SIZE_DIVISOR 8
+
+static Display *display;
+static Window window;
+static GC gc;
+
+static struct Font font;
+static struct TextPen pen;
+#ifdef HAVE_XFT_EXT
+static XftColor xft_color;
+#endif
+
+static Monitor monitors[MAX_MONITORS];
+static size_t num_monitors = 0;
+
+//! The strftime formats of the lines.
+static const char *const line_formats[NUM_LINES] = {"%X", "%x"};
+
+//! A line of text as currently shown on all monitors.
+struct Line {
+  char text[256];
+  int len;
+  //! The width of text.
+  int width;
+};
+static struct Line lines[NUM_LINES];
+
+//! The current burn-in mitigation offset.
+static int x_offset = 0, y_offset = 0;
+static int burnin_mitigation_max_offset = 0;
+static int burnin_mitigation_max_offset_change = 0;
+
+/*! \brief How far drawn glyphs may extend beyond their logical box.
+ */
+static int TextOverhang(void) {
+  return (TextAscent(&font) + TextDescent(&font)) / 4;
+}
+
+/*! \brief Returns the baseline of a line of text on a monitor.
+ */
+static void LinePosition(const Monitor *monitor, int line, int width, int *x,
+                         int *y) {
+  int line_height = TextAscent(&font) + TextDescent(&font) + LINE_SPACING;
+  *x = monitor->x + monitor->width / 2 + x_offset - width / 2;
+  *y = monitor->y + monitor->height / 2 + y_offset -
+       NUM_LINES * line_height / 2 + line * line_height + LINE_SPACING / 2 +
+       TextAscent(&font);
+}
+
+/*! \brief Computes the area a line occupies on a monitor.
+ *
+ * \param from Only return the part from this many pixels into the text on; 0
+ *   includes glyphs overhanging to the left.
+ */
+static XRectangle LineArea(const Monitor *monitor, int line, int from) {
+  int x, y;
+  LinePosition(monitor, line, lines[line].width, &x, &y);
+  int overhang = TextOverhang();
+  int left = x + from - (from == 0 ? overhang : 0);
+  int right = x + lines[line].width + overhang;
+  XRectangle area;
+  area.x = left;
+  area.y = y - TextAscent(&font);
+  area.width = right > left ? right - left : 0;
+  area.height = TextAscent(&font) + TextDescent(&font);
+  return area;
+}
+
+/*! \brief Redraws the part of a line from a given offset into it.
+ *
+ * The whole string is drawn, but clipped, so glyphs of the unchanged part that
+ * reach into the redrawn area stay intact, and the unchanged part isn't drawn
+ * twice (which would make antialiased edges heavier).
+ */
+static void RedrawLinePart(const Monitor *monitor, int line, int from) {
+  XRectangle area = LineArea(monitor, line, from);
+  if (area.width == 0) {
+    return;
+  }
+  XClearArea(display, window, area.x, area.y, area.width, area.height, False);
+  int x, y;
+  LinePosition(monitor, line, lines[line].width, &x, &y);
+#ifdef HAVE_XFT_EXT
+  if (font.xft_font != NULL) {
+    XftDrawSetClipRectangles(pen.xft_draw, 0, 0, &area, 1);
+    DrawText(display, &font, &pen, x, y, lines[line].text, lines[line].len);
+    XftDrawSetClip(pen.xft_draw, None);
+    return;
+  }
+#endif
+  XSetClipRectangles(display, gc, 0, 0, &area, 1, Unsorted);
+  DrawText(display, &font, &pen, x, y, lines[line].text, lines[line].len);
+  XSetClipMask(display, gc, None);
+}
+
+/*! \brief Loads the font, sized to the monitors.
+ */
+static int LoadClockFont(void) {
+  FreeFont(display, &font);
+  int min_height = 0;
+  size_t i;
+  for (i = 0; i < num_monitors; ++i) {
+    if (i == 0 || monitors[i].height < min_height) {
+      min_height = monitors[i].height;
+    }
+  }
+  // Like auth_x11, but scaled; core fonts can't be scaled though.
+  if (!LoadFont(display, GetStringSetting("XSECURELOCK_FONT", ""),
+                min_height > 0 ? min_height / FONT_SIZE_DIVISOR : 12, &font)) {
+    return 0;
+  }
+  if (font.core_font != NULL) {
+    XSetFont(display, gc, font.core_font->fid);
+  }
+  return 1;
+}
+
+/*! \brief Moves the text a bit, within the burn-in mitigation bounds.
+ */
+static void MoveForBurnin(int max_change) {
+  if (max_change <= 0) {
+    return;
+  }
+  x_offset += rand() % (2 * max_change + 1) - max_change;
+  y_offset += rand() % (2 * max_change + 1) - max_change;
+  if (x_offset < -burnin_mitigation_max_offset) {
+    x_offset = -burnin_mitigation_max_offset;
+  }
+  if (x_offset > burnin_mitigation_max_offset) {
+    x_offset = burnin_mitigation_max_offset;
+  }
+  if (y_offset < -burnin_mitigation_max_offset) {
+    y_offset = -burnin_mitigation_max_offset;
+  }
+  if (y_offset > burnin_mitigation_max_offset) {
+    y_offset = burnin_mitigation_max_offset;
+  }
+}
+
+/*! \brief Brings the screen up to date with the current time.
+ *
+ * \param full If set, everything is redrawn; otherwise only what changed.
+ */
+static void Update(time_t now, int full) {
+  struct tm tm_buf;
+  struct tm *tm = localtime_r(&now, &tm_buf);
+  int line;
+  size_t i;
+  for (line = 0; line < NUM_LINES; ++line) {
+    char text[sizeof(lines[line].text)];
+    size_t len = tm == NULL ? 0 : strftime(text, sizeof(text),
+                                           line_formats[line], tm);
+    struct Line *old = &lines[line];
+    if (!full && (int)len == old->len && !memcmp(text, old->text, len)) {
+      continue;
+    }
+    int width = TextAdvance(display, &font, text, len);
+    int prefix = 0;
+    if (!full && width == old->width) {
+      // Same width: the common prefix stays in place.
+      while (prefix < (int)len && prefix < old->len &&
+             text[prefix] == old->text[prefix]) {
+        ++prefix;
+      }
+    } else if (!full) {
+      // Everything moves; clear the whole old line.
+      for (i = 0; i < num_monitors; ++i) {
+        XRectangle area = LineArea(&monitors[i], line, 0);
+        XClearArea(display, window, area.x, area.y, area.width, area.height,
+                   False);
+      }
+    }
+    int from = prefix == 0 ? 0 : TextAdvance(display, &font, text, prefix);
+    memcpy(old->text, text, len);
+    old->len = len;
+    old->width = width;
+    for (i = 0; i < num_monitors; ++i) {
+      RedrawLinePart(&monitors[i], line, from);
+    }
+  }
+}
+
+static void RedrawAll(time_t now) {
+  XClearWindow(display, window);
+  Update(now, 1);
+}
+
+static int RunClock(void) {
+  setlocale(LC_CTYPE, "");
+  setlocale(LC_TIME, "");
+
+  if ((display = XOpenDisplay(NULL)) == NULL) {
+    Log("Could not connect to $DISPLAY");
+    return 1;
+  }
+  window = ReadWindowID();
+  if (window == None) {
+    Log("Invalid/no window ID in XSCREENSAVER_WINDOW");
+    return 1;
+  }
+
+  srand(time(NULL) ^ getpid());
+  burnin_mitigation_max_offset =
+      GetIntSetting("XSECURELOCK_BURNIN_MITIGATION", 16);
+  if (burnin_mitigation_max_offset > 0) {
+    MoveForBurnin(burnin_mitigation_max_offset);
+  }
+  burnin_mitigation_max_offset_change =
+      GetIntSetting("XSECURELOCK_BURNIN_MITIGATION_DYNAMIC", 0);
+
+  Colormap colormap = DefaultColormap(display, DefaultScreen(display));
+  XColor color, dummy;
+  XAllocNamedColor(
+      display, colormap,
+      GetStringSetting("XSECURELOCK_AUTH_FOREGROUND_COLOR", "white"), &color,
+      &dummy);
+  XGCValues gcattrs;
+  gcattrs.foreground = color.pixel;
+  gc = XCreateGC(display, window, GCForeground, &gcattrs);
+  pen.drawable = window;
+  pen.gc = gc;
+#ifdef HAVE_XFT_EXT
+  XRenderColor xrcolor;
+  xrcolor.alpha = 65535;
+  xrcolor.red = color.red;
+  xrcolor.green = color.green;
+  xrcolor.blue = color.blue;
+  XftColorAllocValue(display, DefaultVisual(display, DefaultScreen(display)),
+                     colormap, &xrcolor, &xft_color);
+  pen.xft_draw = XftDrawCreate(display, window,
+                               DefaultVisual(display, DefaultScreen(display)),
+                               colormap);
+  pen.xft_color = &xft_color;
+#endif
+
+  XSelectInput(display, window, ExposureMask | StructureNotifyMask);
+  SelectMonitorChangeEvents(display, window);
+  num_monitors = GetMonitors(display, window, monitors, MAX_MONITORS);
+  if (!LoadClockFont()) {
+    return 1;
+  }
+
+  int x11_fd = ConnectionNumber(display);
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  time_t last_minute = now.tv_sec / 60;
+  RedrawAll(now.tv_sec);
+  for (;;) {
+    XFlush(display);
+    FlushLog();
+
+    // Sleep until the next second starts, or something happens.
+    clock_gettime(CLOCK_REALTIME, &now);
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 1000000 - now.tv_nsec / 1000;
+    if (tv.tv_usec > 999999) {
+      tv.tv_usec = 999999;  // select may reject a full second in tv_usec.
+    }
+    struct timeval settle_timeout;
+    int layout_changed = MonitorChangeSettled(&settle_timeout);
+    if (MonitorChangePending() &&
+        settle_timeout.tv_sec * 1000000L + settle_timeout.tv_usec <
+            tv.tv_usec) {
+      tv = settle_timeout;
+    }
+    fd_set in_fds;
+    FD_ZERO(&in_fds);
+    FD_SET(x11_fd, &in_fds);
+    if (!layout_changed && XPending(display) == 0 &&
+        select(x11_fd + 1, &in_fds, 0, 0, &tv) == -1 && errno != EINTR) {
+      LogErrno("select");
+    }
+
+    int exposed = 0;
+    while (XPending(display)) {
+      XEvent ev;
+      XNextEvent(display, &ev);
+      if (ev.type == Expose && ev.xexpose.count == 0) {
+        exposed = 1;
+      } else if (ev.type == ConfigureNotify) {
+        NoteMonitorChange();
+      } else if (IsMonitorChangeEvent(display, &ev)) {
+        NoteMonitorChange();
+      }
+    }
+    if (MonitorChangeSettled(NULL)) {
+      layout_changed = 1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (layout_changed) {
+      num_monitors = GetMonitors(display, window, monitors, MAX_MONITORS);
+      if (!LoadClockFont()) {
+        return 1;
+      }
+      RedrawAll(now.tv_sec);
+    } else if (burnin_mitigation_max_offset_change > 0 &&
+               now.tv_sec / 60 != last_minute) {
+      // Moving means redrawing everything, so only do it once a minute.
+      MoveForBurnin(burnin_mitigation_max_offset_change);
+      RedrawAll(now.tv_sec);
+    } else if (exposed) {
+      RedrawAll(now.tv_sec);
+    } else {
+      Update(now.tv_sec, 0);
+    }
+    last_minute = now.tv_sec / 60;
+  }
+}
+
+int main() {
+  // Like the script based savers, keep the clock running on SIGUSR1, and let
+  // saver_blank handle blanking the screen.
+  pid_t pid = fork();
+  if (pid == -1) {
+    LogErrno("fork");
+  } else if (pid == 0) {
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGUSR1, &sa, NULL) != 0) {
+      LogErrno("sigaction(SIGUSR1)");
+    }
+    return RunClock();
+  }
+  execl(HELPER_PATH "/saver_blank", "saver_blank", NULL);
+  LogErrno("execl");
+  return 1;
+}
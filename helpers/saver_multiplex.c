@@ -14,17 +14,17 @@ See the License for the specific language governing permissions and
 limitations under the License.
 */
 
-#include <X11/X.h>       // for Window, CopyFromParent, CWBackPixel
+#include <X11/X.h>       // for Window, CopyFromParent, CWBackPixmap
 #include <X11/Xlib.h>    // for XEvent, XFlush, XNextEvent, XOpenDi...
-#include <signal.h>      // for signal, SIGTERM
+#include <signal.h>      // for sigaction, raise, SIGSTOP, SIGTERM
 #include <stdio.h>       // for fprintf, NULL, stderr
 #include <stdlib.h>      // for setenv
-#include <string.h>      // for memcmp, memcpy
+#include <string.h>      // for memcmp
 #include <sys/select.h>  // for select, FD_SET, FD_ZERO, fd_set
 #include <unistd.h>      // for sleep
 
-#include "../env_settings.h"      // for GetStringSetting
-#include "../logging.h"           // for Log, LogErrno
+#include "../env_settings.h"      // for GetIntSetting, GetExecutablePa...
+#include "../logging.h"           // for Log, LogErrno, FlushLog
 #include "../saver_child.h"       // for MAX_SAVERS
 #include "../wait_pgrp.h"         // for InitWaitPgrp
 #include "../wm_properties.h"     // for SetWMProperties
@@ -40,48 +40,162 @@ static void HandleSIGTERM(int signo) {
   raise(signo);                           // Destroys windows we created anyway.
 }
 
+static void HandleSIGUSR2(int signo) {
+  (void)signo;
+  SuspendAllSaverChildrenSigHandler(1);  // Our savers are in their own pgrps.
+  raise(SIGSTOP);
+}
+
+static void HandleSIGCONT(int signo) {
+  (void)signo;
+  SuspendAllSaverChildrenSigHandler(0);
+}
+
 #define MAX_MONITORS MAX_SAVERS
 
 static const char* saver_executable;
+//! If set, run a single saver spanning all monitors.
+static int span_monitors;
 
 static Display* display;
+//! The monitor each slot shows a saver on.
 static Monitor monitors[MAX_MONITORS];
-static size_t num_monitors;
+//! The saver window of each slot, or None if the slot is free.
 static Window windows[MAX_MONITORS];
 
 static void WatchSavers(void) {
   size_t i;
-  for (i = 0; i < num_monitors; ++i) {
-    WatchSaverChild(display, windows[i], i, saver_executable, 1);
+  for (i = 0; i < MAX_MONITORS; ++i) {
+    if (windows[i] != None) {
+      WatchSaverChild(display, windows[i], i, saver_executable, 1);
+    }
   }
 }
 
-static void SpawnSavers(Window parent, int argc, char* const* argv) {
+static void SpawnSaver(size_t i, Window parent, int argc, char* const* argv) {
   XSetWindowAttributes attrs = {0};
-  attrs.background_pixel = BlackPixel(display, DefaultScreen(display));
-  size_t i;
-  for (i = 0; i < num_monitors; ++i) {
-    windows[i] =
-        XCreateWindow(display, parent, monitors[i].x, monitors[i].y,
-                      monitors[i].width, monitors[i].height, 0, CopyFromParent,
-                      InputOutput, CopyFromParent, CWBackPixel, &attrs);
-    SetWMProperties(display, windows[i], "xsecurelock",
-                    "saver_multiplex_screen", argc, argv);
-    XMapRaised(display, windows[i]);
+  // Shows whatever background xsecurelock gave the parent (black, or the
+  // background effect).
+  attrs.background_pixmap = ParentRelative;
+  windows[i] =
+      XCreateWindow(display, parent, monitors[i].x, monitors[i].y,
+                    monitors[i].width, monitors[i].height, 0, CopyFromParent,
+                    InputOutput, CopyFromParent, CWBackPixmap, &attrs);
+  SetWMProperties(display, windows[i], "xsecurelock", "saver_multiplex_screen",
+                  argc, argv);
+  XMapRaised(display, windows[i]);
+}
+
+static void KillSaver(size_t i) {
+  WatchSaverChild(display, windows[i], i, saver_executable, 0);
+  XDestroyWindow(display, windows[i]);
+  windows[i] = None;
+}
+
+/*! \brief Brings the savers in line with a new monitor configuration.
+ *
+ * Savers on unchanged monitors are kept. Savers whose monitor moved or was
+ * resized get their window adjusted. Only for added or removed monitors,
+ * savers get started or killed.
+ *
+ * In span mode, there is only one saver, covering all monitors; it can find
+ * the monitors within its window using GetMonitors.
+ */
+static void UpdateSavers(const Monitor* new_monitors, size_t new_num_monitors,
+                         Window parent, int argc, char* const* argv) {
+  int slot_matched[MAX_MONITORS] = {0};
+  int monitor_matched[MAX_MONITORS] = {0};
+  size_t i, j;
+
+  Monitor span;
+  if (span_monitors && new_num_monitors > 1) {
+    span = new_monitors[0];
+    for (i = 1; i < new_num_monitors; ++i) {
+      const Monitor* m = &new_monitors[i];
+      int right = span.x + span.width, bottom = span.y + span.height;
+      if (m->x + m->width > right) {
+        right = m->x + m->width;
+      }
+      if (m->y + m->height > bottom) {
+        bottom = m->y + m->height;
+      }
+      if (m->x < span.x) {
+        span.x = m->x;
+      }
+      if (m->y < span.y) {
+        span.y = m->y;
+      }
+      span.width = right - span.x;
+      span.height = bottom - span.y;
+    }
+    new_monitors = &span;
+    new_num_monitors = 1;
   }
+
+  // Keep savers whose monitor did not change.
+  for (i = 0; i < MAX_MONITORS; ++i) {
+    if (windows[i] == None) {
+      continue;
+    }
+    for (j = 0; j < new_num_monitors; ++j) {
+      if (!monitor_matched[j] &&
+          !memcmp(&monitors[i], &new_monitors[j], sizeof(Monitor))) {
+        slot_matched[i] = monitor_matched[j] = 1;
+        break;
+      }
+    }
+  }
+
+  // Move remaining savers to remaining monitors, or kill them if none are left.
+  j = 0;
+  for (i = 0; i < MAX_MONITORS; ++i) {
+    if (windows[i] == None || slot_matched[i]) {
+      continue;
+    }
+    while (j < new_num_monitors && monitor_matched[j]) {
+      ++j;
+    }
+    if (j < new_num_monitors) {
+      monitors[i] = new_monitors[j];
+      monitor_matched[j] = 1;
+      XMoveResizeWindow(display, windows[i], monitors[i].x, monitors[i].y,
+                        monitors[i].width, monitors[i].height);
+    } else {
+      KillSaver(i);
+    }
+  }
+
+  // Start savers on the monitors that are still left.
+  i = 0;
+  for (j = 0; j < new_num_monitors; ++j) {
+    if (monitor_matched[j]) {
+      continue;
+    }
+    while (i < MAX_MONITORS && windows[i] != None) {
+      ++i;
+    }
+    if (i >= MAX_MONITORS) {
+      // Can't happen, as there are as many slots as monitors.
+      Log("No free saver slot for monitor %d", (int)j);
+      break;
+    }
+    monitors[i] = new_monitors[j];
+    SpawnSaver(i, parent, argc, argv);
+  }
+
+  if (span_monitors) {
+    for (i = 0; i < MAX_MONITORS; ++i) {
+      if (windows[i] != None) {
+        PublishMonitors(display, &windows[i], 1);
+      }
+    }
+  }
+
   // Need to flush the display so savers sure can access the window.
   XFlush(display);
   WatchSavers();
 }
 
-static void KillSavers(void) {
-  size_t i;
-  for (i = 0; i < num_monitors; ++i) {
-    WatchSaverChild(display, windows[i], i, saver_executable, 0);
-    XDestroyWindow(display, windows[i]);
-  }
-}
-
 /*! \brief The main program.
  *
  * Usage: XSCREENSAVER_WINDOW=window_id ./saver_multiplex
@@ -112,11 +226,13 @@ int main(int argc, char** argv) {
 
   saver_executable =
       GetExecutablePathSetting("XSECURELOCK_SAVER", SAVER_EXECUTABLE, 0);
+  span_monitors = GetIntSetting("XSECURELOCK_SAVER_SPAN_MONITORS", 0);
 
   SelectMonitorChangeEvents(display, parent);
-  num_monitors = GetMonitors(display, parent, monitors, MAX_MONITORS);
-
-  SpawnSavers(parent, argc, argv);
+  Monitor new_monitors[MAX_MONITORS];
+  size_t new_num_monitors =
+      GetMonitors(display, parent, new_monitors, MAX_MONITORS);
+  UpdateSavers(new_monitors, new_num_monitors, parent, argc, argv);
 
   struct sigaction sa;
   sigemptyset(&sa.sa_mask);
@@ -130,30 +246,49 @@ int main(int argc, char** argv) {
   if (sigaction(SIGTERM, &sa, NULL) != 0) {
     LogErrno("sigaction(SIGTERM)");
   }
+  sa.sa_flags = 0;
+  sa.sa_handler = HandleSIGUSR2;  // To suspend children.
+  if (sigaction(SIGUSR2, &sa, NULL) != 0) {
+    LogErrno("sigaction(SIGUSR2)");
+  }
+  sa.sa_handler = HandleSIGCONT;  // To continue children.
+  if (sigaction(SIGCONT, &sa, NULL) != 0) {
+    LogErrno("sigaction(SIGCONT)");
+  }
+  // xsecurelock holds back suspend requests until we can handle them.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR2);
+  if (sigprocmask(SIG_UNBLOCK, &set, NULL) != 0) {
+    LogErrno("sigprocmask");
+  }
 
   InitWaitPgrp();
 
+  struct timeval settle_timeout;
   for (;;) {
     fd_set in_fds;
     FD_ZERO(&in_fds);
     FD_SET(x11_fd, &in_fds);
-    select(x11_fd + 1, &in_fds, 0, 0, NULL);
+    // Come back soon to retry writing log messages stderr did not take yet.
+    struct timeval log_timeout = {0, LOG_FLUSH_INTERVAL_MS * 1000};
+    int log_pending = FlushLog();
+    select(x11_fd + 1, &in_fds, 0, 0,
+           MonitorChangePending() ? &settle_timeout
+                                  : log_pending ? &log_timeout : NULL);
     WatchSavers();
     XEvent ev;
     while (XPending(display) && (XNextEvent(display, &ev), 1)) {
-      if (IsMonitorChangeEvent(display, ev.type)) {
-        Monitor new_monitors[MAX_SAVERS];
-        size_t new_num_monitors =
-            GetMonitors(display, parent, new_monitors, MAX_SAVERS);
-        if (new_num_monitors != num_monitors ||
-            memcmp(new_monitors, monitors, sizeof(monitors)) != 0) {
-          KillSavers();
-          num_monitors = new_num_monitors;
-          memcpy(monitors, new_monitors, sizeof(monitors));
-          SpawnSavers(parent, argc, argv);
-        }
+      if (IsMonitorChangeEvent(display, &ev)) {
+        NoteMonitorChange();
       }
     }
+    // Only look at the monitors once they stopped changing.
+    if (MonitorChangeSettled(&settle_timeout)) {
+      new_num_monitors =
+          GetMonitors(display, parent, new_monitors, MAX_MONITORS);
+      UpdateSavers(new_monitors, new_num_monitors, parent, argc, argv);
+    }
   }
 
   return 0;
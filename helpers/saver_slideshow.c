@@ -0,0 +1,782 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+/*!
+ *\brief Image slideshow saver.
+ *
+ *Shows the JPEG images (by file name extension) listed by
+ *$XSECURELOCK_LIST_VIDEOS_COMMAND in random order, scaled to fit each monitor
+ *in the saver window (there can be more than one with
+ *XSECURELOCK_SAVER_SPAN_MONITORS). The next image is decoded once and scaled
+ *on a worker thread while the current one is shown, and uploaded using MIT-SHM
+ *if possible. This is a lot cheaper than running mpv for the same.
+ *
+ *Usage: XSCREENSAVER_WINDOW=window_id ./saver_slideshow
+ */
+
+#include <X11/X.h>       // for Window, ZPixmap, Expose, ConfigureNotify
+#include <X11/Xlib.h>    // for XImage, XPutImage, XCreateImage, XNextEvent
+#include <X11/Xutil.h>   // for XDestroyImage, XPutPixel
+#include <errno.h>       // for errno, EINTR
+#include <pthread.h>     // for pthread_create, pthread_mutex_lock, pthrea...
+#include <setjmp.h>      // for longjmp, setjmp, jmp_buf
+#include <signal.h>      // for sigaction, sigemptyset, SIGUSR1, SIG_IGN
+#include <stdarg.h>      // for va_end, va_list, va_start
+#include <stdint.h>      // for uint32_t
+#include <stdio.h>       // for fclose, fgets, fopen, pclose, popen, vsnp...
+#include <stdlib.h>      // for free, malloc, random, realloc, srandom
+#include <string.h>      // for memset, strcspn, strdup, strrchr
+#include <strings.h>     // for strcasecmp
+#include <sys/select.h>  // for select, FD_ISSET, FD_SET, FD_ZERO, fd_set
+#include <time.h>        // for clock_gettime, timespec, CLOCK_MONOTONIC
+#include <unistd.h>      // for close, execl, fork, getpid, pipe, read
+
+#include <jpeglib.h>  // for jpeg_decompress_struct, jpeg_read_scanlines
+
+#ifdef HAVE_XSHM_EXT
+#include <X11/extensions/XShm.h>  // for XShmSegmentInfo, XShmAttach, XShmC...
+#include <sys/ipc.h>              // for IPC_CREAT, IPC_PRIVATE, IPC_RMID
+#include <sys/shm.h>              // for shmat, shmctl, shmdt, shmget
+#endif
+
+#include "../env_settings.h"      // for GetIntSetting
+#include "../logging.h"           // for Log, LogErrno, FlushLog
+#include "../xscreensaver_api.h"  // for ReadWindowID
+#include "monitors.h"             // for GetMonitors, IsMonitorChangeEvent
+
+/*! \brief How long to wait before trying again if no image could be shown.
+ */
+#define RETRY_DELAY_MS 10000
+
+#define MAX_MONITORS 16
+
+//! An image the size of the saver window.
+struct Frame {
+  //! The image; its data is written to by the worker thread.
+  XImage *image;
+#ifdef HAVE_XSHM_EXT
+  //! The shared memory segment holding the image data, if use_shm is set.
+  XShmSegmentInfo shminfo;
+  //! Whether the image data is shared with the X server.
+  int use_shm;
+#endif
+};
+
+//! How to place one color channel into a pixel value.
+struct Channel {
+  //! The lowest bit of the channel.
+  int shift;
+  //! The number of bits of the channel.
+  int bits;
+};
+
+static Display *display;
+static Window window;
+static GC gc;
+static Visual *visual;
+static int depth;
+//! The size of the window, and thus of all frames.
+static int width, height;
+//! The red, green and blue channels of the visual.
+static struct Channel channels[3];
+#ifdef HAVE_XSHM_EXT
+//! Whether MIT-SHM may be used.
+static int have_shm = 0;
+//! Set if an X error happened while attaching shared memory.
+static int shm_error = 0;
+#endif
+
+//! The monitors within the window; only changed while the worker is idle.
+static Monitor monitors[MAX_MONITORS];
+static size_t num_monitors = 0;
+
+//! The shown and the next frame; they swap roles on each image change.
+static struct Frame frames[2];
+//! The frame currently on screen, or -1 if none.
+static int shown_frame = -1;
+
+//! Protects worker_request and worker_image.
+static pthread_mutex_t worker_mutex = PTHREAD_MUTEX_INITIALIZER;
+//! Signaled when a new request is available.
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+//! The file the worker shall decode next, or NULL if there is none.
+static char *worker_request = NULL;
+//! The image the worker shall decode into.
+static XImage *worker_image = NULL;
+//! The worker writes one byte into this pipe per request; 1 means success.
+static int worker_done_fds[2];
+//! Why the worker's last request failed; read after its byte in the pipe.
+static char worker_error[256];
+//! The errno belonging to worker_error, or 0 if none.
+static int worker_errno;
+
+//! The shuffled list of image files.
+static char **files = NULL;
+static size_t num_files = 0;
+//! The next entry of files to show.
+static size_t next_file = 0;
+
+static long long MonotonicMilliseconds(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+    LogErrno("clock_gettime");
+    return 0;
+  }
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+//! How many listed files were last reported as skipped.
+static size_t logged_skipped_files = 0;
+
+/*! \brief Checks whether a file looks like a JPEG image by its name.
+ *
+ * The listing is shared with the video savers, so it usually contains plenty
+ * of files we cannot decode; this avoids trying (and failing) each of them.
+ */
+static int IsJpegFileName(const char *path) {
+  const char *base = strrchr(path, '/');
+  const char *ext = strrchr(base != NULL ? base : path, '.');
+  if (ext == NULL) {
+    return 0;
+  }
+  return strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0 ||
+         strcasecmp(ext, ".jpe") == 0 || strcasecmp(ext, ".jfif") == 0;
+}
+
+/*! \brief Lists and shuffles all JPEG image files.
+ */
+static void ListFiles(void) {
+  size_t i;
+  for (i = 0; i < num_files; ++i) {
+    free(files[i]);
+  }
+  num_files = 0;
+  next_file = 0;
+
+  // This uses the same cached listing as the script based savers.
+  const char *command = HELPER_PATH "/media_index";
+  FILE *list = popen(command, "r");
+  if (list == NULL) {
+    LogErrno("popen(%s)", command);
+    return;
+  }
+  size_t files_size = num_files;
+  size_t skipped_files = 0;
+  char line[4096];
+  while (fgets(line, sizeof(line), list) != NULL) {
+    line[strcspn(line, "\n")] = 0;
+    if (!*line) {
+      continue;
+    }
+    if (!IsJpegFileName(line)) {
+      ++skipped_files;
+      continue;
+    }
+    if (num_files >= files_size) {
+      size_t new_size = files_size ? files_size * 2 : 256;
+      char **new_files = realloc(files, new_size * sizeof(*files));
+      if (new_files == NULL) {
+        Log("Out of memory listing images");
+        break;
+      }
+      files = new_files;
+      files_size = new_size;
+    }
+    files[num_files] = strdup(line);
+    if (files[num_files] != NULL) {
+      ++num_files;
+    }
+  }
+  pclose(list);
+  // The listing is redone all the time, so only report changes.
+  if (skipped_files != logged_skipped_files) {
+    Log("Skipping %lu listed files that are not JPEG images",
+        (unsigned long)skipped_files);
+    logged_skipped_files = skipped_files;
+  }
+
+  for (i = num_files; i > 1; --i) {
+    size_t j = random() % i;
+    char *tmp = files[i - 1];
+    files[i - 1] = files[j];
+    files[j] = tmp;
+  }
+}
+
+/*! \brief Records why the worker's current request failed.
+ *
+ * The worker must not log by itself, as logging is not thread-safe. Instead,
+ * the main thread logs this message once the worker reported the failure.
+ *
+ * \param errno_value The errno to append to the message, or 0 for none.
+ */
+static void WorkerError(int errno_value, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  vsnprintf(worker_error, sizeof(worker_error), format, args);
+  va_end(args);
+  worker_errno = errno_value;
+}
+
+struct JpegErrorManager {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void JpegErrorExit(j_common_ptr cinfo) {
+  char message[JMSG_LENGTH_MAX];
+  cinfo->err->format_message(cinfo, message);
+  WorkerError(0, "Could not decode image: %s", message);
+  longjmp(((struct JpegErrorManager *)cinfo->err)->jump, 1);
+}
+
+static void JpegOutputMessage(j_common_ptr cinfo) {
+  // Corrupt-but-decodable images are common enough to not warn about.
+  (void)cinfo;
+}
+
+/*! \brief Computes the largest size of an image fitting into a monitor.
+ */
+static void FitImage(long long image_width, long long image_height,
+                     const Monitor *monitor, int *fit_width, int *fit_height) {
+  if (image_width * monitor->height > image_height * monitor->width) {
+    *fit_width = monitor->width;
+    *fit_height = image_height * monitor->width / image_width;
+  } else {
+    *fit_height = monitor->height;
+    *fit_width = image_width * monitor->height / image_height;
+  }
+  if (*fit_width < 1) {
+    *fit_width = 1;
+  }
+  if (*fit_height < 1) {
+    *fit_height = 1;
+  }
+}
+
+/*! \brief Scales decoded RGB pixels to fit into a monitor of an image.
+ *
+ * Parts of the monitor outside of the image are skipped, as the monitor
+ * layout and the frame size may not have caught up with each other.
+ */
+static void ScaleToMonitor(const JSAMPLE *pixels, int pixels_width,
+                           int pixels_height, XImage *image,
+                           const Monitor *monitor, int *x_map) {
+  size_t row_size = (size_t)pixels_width * 3;
+  int fit_width, fit_height;
+  FitImage(pixels_width, pixels_height, monitor, &fit_width, &fit_height);
+  long long x, y;
+  for (x = 0; x < fit_width; ++x) {
+    x_map[x] = x * pixels_width / fit_width * 3;
+  }
+  int x_offset = monitor->x + (monitor->width - fit_width) / 2;
+  int y_offset = monitor->y + (monitor->height - fit_height) / 2;
+  int x_begin = x_offset < 0 ? -x_offset : 0;
+  int x_end = x_offset + fit_width > image->width ? image->width - x_offset
+                                                  : fit_width;
+  int y_begin = y_offset < 0 ? -y_offset : 0;
+  int y_end = y_offset + fit_height > image->height ? image->height - y_offset
+                                                    : fit_height;
+  const uint32_t one = 1;
+  int direct = image->bits_per_pixel == 32 &&
+               (image->byte_order == LSBFirst) == (*(const char *)&one == 1);
+  for (y = y_begin; y < y_end; ++y) {
+    const JSAMPLE *row = pixels + y * pixels_height / fit_height * row_size;
+    char *out = image->data + (size_t)(y + y_offset) * image->bytes_per_line;
+    for (x = x_begin; x < x_end; ++x) {
+      const JSAMPLE *rgb = row + x_map[x];
+      unsigned long pixel = 0;
+      int c;
+      for (c = 0; c < 3; ++c) {
+        pixel |= (unsigned long)(rgb[c] >> (8 - channels[c].bits))
+                 << channels[c].shift;
+      }
+      if (direct) {
+        ((uint32_t *)out)[x + x_offset] = pixel;
+      } else {
+        XPutPixel(image, x + x_offset, y + y_offset, pixel);
+      }
+    }
+  }
+}
+
+/*! \brief Decodes a JPEG file and scales it to fit into each monitor.
+ *
+ * Runs on the worker thread, so this must not call into Xlib except for image
+ * manipulation functions, and must report errors using WorkerError.
+ *
+ * \return Whether the image was decoded.
+ */
+static int DecodeImage(const char *path, XImage *image) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    WorkerError(errno, "fopen(%s)", path);
+    return 0;
+  }
+
+  struct jpeg_decompress_struct cinfo;
+  struct JpegErrorManager err;
+  JSAMPLE *volatile pixels = NULL;
+  int *volatile x_map = NULL;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = JpegErrorExit;
+  err.mgr.output_message = JpegOutputMessage;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(pixels);
+    free(x_map);
+    fclose(file);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, file);
+  jpeg_read_header(&cinfo, TRUE);
+  cinfo.out_color_space = JCS_RGB;
+
+  // The image is decoded once, at the size the largest monitor needs.
+  int max_fit_width = 1, max_fit_height = 1;
+  size_t i;
+  for (i = 0; i < num_monitors; ++i) {
+    int fit_width, fit_height;
+    FitImage(cinfo.image_width, cinfo.image_height, &monitors[i], &fit_width,
+             &fit_height);
+    if (fit_width > max_fit_width) {
+      max_fit_width = fit_width;
+    }
+    if (fit_height > max_fit_height) {
+      max_fit_height = fit_height;
+    }
+  }
+
+  // Let libjpeg do as much of the downscaling as possible, as it can skip most
+  // of the decoding work for it.
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 1;
+  while (cinfo.scale_denom < 8 &&
+         cinfo.image_width >= max_fit_width * cinfo.scale_denom * 2 &&
+         cinfo.image_height >= max_fit_height * cinfo.scale_denom * 2) {
+    cinfo.scale_denom *= 2;
+  }
+  jpeg_start_decompress(&cinfo);
+  size_t row_size = (size_t)cinfo.output_width * 3;
+  pixels = malloc(row_size * cinfo.output_height);
+  x_map = malloc(max_fit_width * sizeof(*x_map));
+  if (pixels == NULL || x_map == NULL) {
+    WorkerError(0, "Out of memory decoding %s", path);
+    longjmp(err.jump, 1);
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = pixels + cinfo.output_scanline * row_size;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(file);
+
+  // Scale the rest of the way.
+  memset(image->data, 0, (size_t)image->bytes_per_line * image->height);
+  for (i = 0; i < num_monitors; ++i) {
+    ScaleToMonitor(pixels, cinfo.output_width, cinfo.output_height, image,
+                   &monitors[i], x_map);
+  }
+  free(pixels);
+  free(x_map);
+  return 1;
+}
+
+static void *WorkerThread(void *arg) {
+  (void)arg;
+  for (;;) {
+    pthread_mutex_lock(&worker_mutex);
+    while (worker_request == NULL) {
+      pthread_cond_wait(&worker_cond, &worker_mutex);
+    }
+    char *path = worker_request;
+    XImage *image = worker_image;
+    worker_request = NULL;
+    pthread_mutex_unlock(&worker_mutex);
+
+    char result = DecodeImage(path, image);
+    free(path);
+    while (write(worker_done_fds[1], &result, 1) == -1 && errno == EINTR) {
+    }
+  }
+  return NULL;
+}
+
+/*! \brief Asks the worker to decode the next image into the hidden frame.
+ *
+ * \return Whether a request was made; if not, there are no images.
+ */
+static int RequestNextImage(void) {
+  if (next_file >= num_files) {
+    ListFiles();
+  }
+  if (next_file >= num_files) {
+    return 0;
+  }
+  char *path = strdup(files[next_file++]);
+  if (path == NULL) {
+    return 0;
+  }
+  pthread_mutex_lock(&worker_mutex);
+  worker_request = path;
+  worker_image = frames[shown_frame == 0 ? 1 : 0].image;
+  pthread_cond_signal(&worker_cond);
+  pthread_mutex_unlock(&worker_mutex);
+  return 1;
+}
+
+/*! \brief Waits for the worker to finish its current request.
+ *
+ * \return Whether it decoded the image successfully.
+ */
+static int WaitForWorker(void) {
+  char result;
+  ssize_t got;
+  while ((got = read(worker_done_fds[0], &result, 1)) == -1 &&
+         errno == EINTR) {
+  }
+  if (got != 1) {
+    if (got == -1) {
+      LogErrno("read");
+    }
+    return 0;
+  }
+  if (!result) {
+    if (worker_errno != 0) {
+      errno = worker_errno;
+      LogErrno("%s", worker_error);
+    } else {
+      Log("%s", worker_error);
+    }
+  }
+  return result;
+}
+
+#ifdef HAVE_XSHM_EXT
+static int CatchShmError(Display *dpy, XErrorEvent *error) {
+  (void)dpy;
+  (void)error;
+  shm_error = 1;
+  return 0;
+}
+#endif
+
+static int CreateFrame(struct Frame *frame) {
+#ifdef HAVE_XSHM_EXT
+  if (have_shm) {
+    frame->image = XShmCreateImage(display, visual, depth, ZPixmap, NULL,
+                                   &frame->shminfo, width, height);
+    if (frame->image != NULL) {
+      frame->shminfo.shmid = shmget(
+          IPC_PRIVATE, (size_t)frame->image->bytes_per_line * height,
+          IPC_CREAT | 0600);
+      if (frame->shminfo.shmid != -1) {
+        frame->shminfo.shmaddr = frame->image->data =
+            shmat(frame->shminfo.shmid, NULL, 0);
+        if (frame->shminfo.shmaddr != (char *)-1) {
+          frame->shminfo.readOnly = False;
+          shm_error = 0;
+          XErrorHandler old_handler = XSetErrorHandler(CatchShmError);
+          XShmAttach(display, &frame->shminfo);
+          XSync(display, False);
+          XSetErrorHandler(old_handler);
+          // Either way, the segment can go away once nobody uses it anymore.
+          shmctl(frame->shminfo.shmid, IPC_RMID, NULL);
+          if (!shm_error) {
+            frame->use_shm = 1;
+            return 1;
+          }
+          shmdt(frame->shminfo.shmaddr);
+        } else {
+          shmctl(frame->shminfo.shmid, IPC_RMID, NULL);
+        }
+      }
+      frame->image->data = NULL;
+      XDestroyImage(frame->image);
+      frame->image = NULL;
+    }
+    Log("Could not use MIT-SHM; falling back to XPutImage");
+    have_shm = 0;
+  }
+  frame->use_shm = 0;
+#endif
+  frame->image = XCreateImage(display, visual, depth, ZPixmap, 0, NULL, width,
+                              height, 32, 0);
+  if (frame->image == NULL) {
+    Log("XCreateImage failed");
+    return 0;
+  }
+  frame->image->data = malloc((size_t)frame->image->bytes_per_line * height);
+  if (frame->image->data == NULL) {
+    Log("Out of memory creating a %dx%d image", width, height);
+    XDestroyImage(frame->image);
+    frame->image = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void DestroyFrame(struct Frame *frame) {
+  if (frame->image == NULL) {
+    return;
+  }
+#ifdef HAVE_XSHM_EXT
+  if (frame->use_shm) {
+    XShmDetach(display, &frame->shminfo);
+    XSync(display, False);
+    shmdt(frame->shminfo.shmaddr);
+    frame->image->data = NULL;
+    frame->use_shm = 0;
+  }
+#endif
+  XDestroyImage(frame->image);
+  frame->image = NULL;
+}
+
+static void ShowFrame(struct Frame *frame) {
+#ifdef HAVE_XSHM_EXT
+  if (frame->use_shm) {
+    XShmPutImage(display, window, gc, frame->image, 0, 0, 0, 0, width, height,
+                 False);
+  } else
+#endif
+  {
+    XPutImage(display, window, gc, frame->image, 0, 0, 0, 0, width, height);
+  }
+  // The worker may only touch this frame again once the X server is done with
+  // it.
+  XSync(display, False);
+}
+
+static int CreateFrames(void) {
+  shown_frame = -1;
+  return CreateFrame(&frames[0]) && CreateFrame(&frames[1]);
+}
+
+static void DestroyFrames(void) {
+  DestroyFrame(&frames[0]);
+  DestroyFrame(&frames[1]);
+}
+
+static void InitChannel(struct Channel *channel, unsigned long mask) {
+  channel->shift = 0;
+  channel->bits = 0;
+  while (mask != 0 && !(mask & 1)) {
+    mask >>= 1;
+    ++channel->shift;
+  }
+  while (mask & 1) {
+    mask >>= 1;
+    ++channel->bits;
+  }
+  if (channel->bits > 8) {
+    // Just use the top bits.
+    channel->shift += channel->bits - 8;
+    channel->bits = 8;
+  }
+}
+
+static int RunSlideshow(void) {
+  if ((display = XOpenDisplay(NULL)) == NULL) {
+    Log("Could not connect to $DISPLAY");
+    return 1;
+  }
+  window = ReadWindowID();
+  if (window == None) {
+    Log("Invalid/no window ID in XSCREENSAVER_WINDOW");
+    return 1;
+  }
+  XWindowAttributes xwa;
+  if (!XGetWindowAttributes(display, window, &xwa)) {
+    Log("Could not get window attributes");
+    return 1;
+  }
+  visual = xwa.visual;
+  depth = xwa.depth;
+  width = xwa.width;
+  height = xwa.height;
+  if (visual->class != TrueColor) {
+    Log("Only TrueColor visuals are supported");
+    return 1;
+  }
+  InitChannel(&channels[0], visual->red_mask);
+  InitChannel(&channels[1], visual->green_mask);
+  InitChannel(&channels[2], visual->blue_mask);
+#ifdef HAVE_XSHM_EXT
+  have_shm = XShmQueryExtension(display);
+#endif
+  gc = XCreateGC(display, window, 0, NULL);
+  XSelectInput(display, window, ExposureMask | StructureNotifyMask);
+  SelectMonitorChangeEvents(display, window);
+  num_monitors = GetMonitors(display, window, monitors, MAX_MONITORS);
+
+  long long duration_ms =
+      GetIntSetting("XSECURELOCK_IMAGE_DURATION_SECONDS", 1) * 1000LL;
+  srandom(MonotonicMilliseconds() ^ getpid());
+
+  if (pipe(worker_done_fds) != 0) {
+    LogErrno("pipe");
+    return 1;
+  }
+  pthread_t worker;
+  int err = pthread_create(&worker, NULL, WorkerThread, NULL);
+  if (err != 0) {
+    Log("pthread_create failed: %d", err);
+    return 1;
+  }
+
+  if (!CreateFrames()) {
+    return 1;
+  }
+  int x11_fd = ConnectionNumber(display);
+  int worker_busy = RequestNextImage();
+  int next_frame_ready = 0;
+  int consecutive_failures = 0;
+  long long next_change_time = 0;  // Show the first image right away.
+  long long retry_time = worker_busy ? -1 : MonotonicMilliseconds();
+  for (;;) {
+    long long now = MonotonicMilliseconds();
+    if (next_frame_ready && now >= next_change_time) {
+      shown_frame = shown_frame == 0 ? 1 : 0;
+      ShowFrame(&frames[shown_frame]);
+      next_frame_ready = 0;
+      next_change_time = now + duration_ms;
+      // Prefetch the next image while this one is on screen.
+      worker_busy = RequestNextImage();
+      retry_time = worker_busy ? -1 : now;
+    }
+    if (!worker_busy && !next_frame_ready && retry_time >= 0 &&
+        now >= retry_time + RETRY_DELAY_MS) {
+      worker_busy = RequestNextImage();
+      retry_time = worker_busy ? -1 : now;
+    }
+
+    long long wait_ms = -1;
+    if (next_frame_ready) {
+      wait_ms = next_change_time - now;
+    } else if (!worker_busy && retry_time >= 0) {
+      wait_ms = retry_time + RETRY_DELAY_MS - now;
+    }
+    int layout_changed = 0;
+    struct timeval settle_timeout;
+    if (MonitorChangeSettled(&settle_timeout)) {
+      layout_changed = 1;
+      wait_ms = 0;
+    } else if (MonitorChangePending()) {
+      long long settle_ms =
+          settle_timeout.tv_sec * 1000LL + settle_timeout.tv_usec / 1000;
+      if (wait_ms < 0 || settle_ms < wait_ms) {
+        wait_ms = settle_ms;
+      }
+    }
+    // Come back soon to retry writing log messages stderr did not take yet.
+    if (FlushLog() && (wait_ms < 0 || wait_ms > LOG_FLUSH_INTERVAL_MS)) {
+      wait_ms = LOG_FLUSH_INTERVAL_MS;
+    }
+    struct timeval tv;
+    if (wait_ms >= 0) {
+      tv.tv_sec = wait_ms / 1000;
+      tv.tv_usec = (wait_ms % 1000) * 1000;
+    }
+    fd_set in_fds;
+    FD_ZERO(&in_fds);
+    FD_SET(x11_fd, &in_fds);
+    if (worker_busy) {
+      FD_SET(worker_done_fds[0], &in_fds);
+    }
+    int nfds = (x11_fd > worker_done_fds[0] ? x11_fd : worker_done_fds[0]) + 1;
+    if (XPending(display) == 0 &&
+        select(nfds, &in_fds, 0, 0, wait_ms >= 0 ? &tv : NULL) == -1) {
+      FD_ZERO(&in_fds);
+      if (errno != EINTR) {
+        LogErrno("select");
+      }
+    }
+
+    if (worker_busy && FD_ISSET(worker_done_fds[0], &in_fds)) {
+      worker_busy = 0;
+      if (WaitForWorker()) {
+        next_frame_ready = 1;
+        consecutive_failures = 0;
+      } else if (++consecutive_failures < (int)num_files) {
+        worker_busy = RequestNextImage();
+      } else {
+        Log("None of the %d listed files could be shown", (int)num_files);
+        consecutive_failures = 0;
+        retry_time = MonotonicMilliseconds();
+      }
+    }
+
+    while (XPending(display)) {
+      XEvent ev;
+      XNextEvent(display, &ev);
+      if (ev.type == Expose && ev.xexpose.count == 0 && shown_frame >= 0) {
+        ShowFrame(&frames[shown_frame]);
+      } else if (ev.type == ConfigureNotify &&
+                 (ev.xconfigure.width != width ||
+                  ev.xconfigure.height != height)) {
+        width = ev.xconfigure.width;
+        height = ev.xconfigure.height;
+        layout_changed = 1;
+      } else if (IsMonitorChangeEvent(display, &ev)) {
+        NoteMonitorChange();
+      }
+    }
+    if (MonitorChangeSettled(NULL)) {
+      layout_changed = 1;
+    }
+    if (layout_changed) {
+      // The frames are in use by the worker, so let it finish first.
+      if (worker_busy) {
+        WaitForWorker();
+        worker_busy = 0;
+      }
+      num_monitors = GetMonitors(display, window, monitors, MAX_MONITORS);
+      DestroyFrames();
+      if (!CreateFrames()) {
+        return 1;
+      }
+      XClearWindow(display, window);
+      next_frame_ready = 0;
+      next_change_time = 0;
+      worker_busy = RequestNextImage();
+      retry_time = worker_busy ? -1 : MonotonicMilliseconds();
+    }
+  }
+}
+
+int main() {
+  // Like the script based savers, keep the slideshow running on SIGUSR1, and
+  // let saver_blank handle blanking the screen.
+  pid_t pid = fork();
+  if (pid == -1) {
+    LogErrno("fork");
+  } else if (pid == 0) {
+    struct sigaction sa;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sa.sa_handler = SIG_IGN;
+    if (sigaction(SIGUSR1, &sa, NULL) != 0) {
+      LogErrno("sigaction(SIGUSR1)");
+    }
+    return RunSlideshow();
+  }
+  execl(HELPER_PATH "/saver_blank", "saver_blank", NULL);
+  LogErrno("execl");
+  return 1;
+}
@@ -0,0 +1,245 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "text.h"
+
+#include <stddef.h>  // for NULL, offsetof
+#include <string.h>  // for strcmp, strlen
+
+#ifdef HAVE_XFT_EXT
+#include <X11/Xft/Xft.h>             // for XftFontOpenPattern, XftNameParse
+#include <X11/extensions/Xrender.h>  // for XGlyphInfo
+#include <fontconfig/fontconfig.h>   // for FcPatternDel, FcNameParse
+#endif
+
+#include "../logging.h"           // for Log
+#include "../session_snapshot.h"  // for GetSessionSnapshot, UpdateSession...
+
+#ifdef HAVE_XFT_EXT
+/*! \brief Shares the resolved font with later auth_x11 instances.
+ *
+ * Stored in the session snapshot; the name goes last, as it marks the pattern
+ * as valid.
+ */
+static void StoreAuthFont(const char *name, FcPattern *match) {
+  const struct SessionSnapshot *snapshot = GetSessionSnapshot();
+  if (snapshot == NULL || strlen(name) >= sizeof(snapshot->auth_font_name)) {
+    return;
+  }
+  FcPattern *copy = FcPatternDuplicate(match);
+  if (copy == NULL) {
+    return;
+  }
+  // Not needed to open the font, but potentially long.
+  FcPatternDel(copy, FC_LANG);
+  char pattern[sizeof(snapshot->auth_font_pattern)];
+  int have_pattern = XftNameUnparse(copy, pattern, sizeof(pattern));
+  FcPatternDestroy(copy);
+  if (!have_pattern) {
+    Log("Resolved font pattern for %s is too long; not sharing it", name);
+    return;
+  }
+  if (UpdateSessionSnapshot(offsetof(struct SessionSnapshot, auth_font_pattern),
+                            pattern, strlen(pattern) + 1)) {
+    UpdateSessionSnapshot(offsetof(struct SessionSnapshot, auth_font_name),
+                          name, strlen(name) + 1);
+  }
+}
+
+/*! \brief Opens an Xft font.
+ *
+ * Unscaled fonts are the ones of the auth dialog. They are opened using the
+ * pattern from the session snapshot if possible, which skips fontconfig
+ * matching; otherwise, the matched pattern is stored there.
+ *
+ * \return The font, or NULL on failure.
+ */
+static XftFont *OpenXftFont(Display *display, const char *name,
+                            int pixel_size) {
+  const struct SessionSnapshot *snapshot = GetSessionSnapshot();
+  if (pixel_size <= 0 && snapshot != NULL &&
+      snapshot->auth_font_pattern[0] != 0 &&
+      strcmp(snapshot->auth_font_name, name) == 0) {
+    FcPattern *pattern =
+        FcNameParse((const FcChar8 *)snapshot->auth_font_pattern);
+    if (pattern != NULL) {
+      // The pattern is fully resolved already, so no matching is needed.
+      XftFont *font = XftFontOpenPattern(display, pattern);
+      if (font != NULL) {
+        return font;  // The font now owns the pattern.
+      }
+      FcPatternDestroy(pattern);
+    }
+    Log("Could not open the resolved font for %s; matching again", name);
+  }
+  FcPattern *pattern = XftNameParse(name);
+  if (pattern == NULL) {
+    return NULL;
+  }
+  if (pixel_size > 0) {
+    FcPatternDel(pattern, FC_SIZE);
+    FcPatternDel(pattern, FC_PIXEL_SIZE);
+    FcPatternAddDouble(pattern, FC_PIXEL_SIZE, pixel_size);
+  }
+  FcResult result;
+  FcPattern *match =
+      XftFontMatch(display, DefaultScreen(display), pattern, &result);
+  FcPatternDestroy(pattern);
+  if (match == NULL) {
+    return NULL;
+  }
+  if (pixel_size <= 0) {
+    StoreAuthFont(name, match);
+  }
+  XftFont *font = XftFontOpenPattern(display, match);
+  if (font == NULL) {
+    FcPatternDestroy(match);
+  }
+  return font;  // The font now owns the pattern.
+}
+#endif
+
+int LoadFont(Display *display, const char *name, int pixel_size,
+             struct Font *font) {
+  font->core_font = NULL;
+#ifdef HAVE_XFT_EXT
+  font->xft_font = NULL;
+#else
+  (void)pixel_size;
+#endif
+
+  // First try parsing the font name as an X11 core font. We're trying these
+  // first as their font name format is more restrictive (usually starts with a
+  // dash), except for when font aliases are used.
+  if (name[0] != 0) {
+    font->core_font = XLoadQueryFont(display, name);
+    if (font->core_font != NULL) {
+      return 1;
+    }
+#ifdef HAVE_XFT_EXT
+    font->xft_font = OpenXftFont(display, name, pixel_size);
+    if (font->xft_font != NULL) {
+      return 1;
+    }
+#endif
+    Log("Could not load the specified font %s - trying a default font", name);
+  }
+#ifdef HAVE_XFT_EXT
+  font->xft_font = OpenXftFont(display, "monospace", pixel_size);
+  if (font->xft_font != NULL) {
+    return 1;
+  }
+#endif
+  font->core_font = XLoadQueryFont(display, "fixed");
+  if (font->core_font != NULL) {
+    return 1;
+  }
+  Log("Could not load a mind-bogglingly stupid font");
+  return 0;
+}
+
+void FreeFont(Display *display, struct Font *font) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    XftFontClose(display, font->xft_font);
+    font->xft_font = NULL;
+  }
+#endif
+  if (font->core_font != NULL) {
+    XFreeFont(display, font->core_font);
+    font->core_font = NULL;
+  }
+}
+
+int TextAscent(const struct Font *font) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    return font->xft_font->ascent;
+  }
+#endif
+  return font->core_font->max_bounds.ascent;
+}
+
+int TextDescent(const struct Font *font) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    return font->xft_font->descent;
+  }
+#endif
+  return font->core_font->max_bounds.descent;
+}
+
+int TextAdvance(Display *display, const struct Font *font, const char *string,
+                int len) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    XGlyphInfo extents;
+    XftTextExtentsUtf8(display, font->xft_font, (const FcChar8 *)string, len,
+                       &extents);
+    return extents.xOff;
+  }
+#else
+  (void)display;
+#endif
+  return XTextWidth(font->core_font, string, len);
+}
+
+int TextExpandAmount(Display *display, const struct Font *font,
+                     const char *string, int len) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    XGlyphInfo extents;
+    XftTextExtentsUtf8(display, font->xft_font, (const FcChar8 *)string, len,
+                       &extents);
+    // Use whichever is larger - visible bounding box (bigger if font is
+    // italic) or spacing to next character (bigger if last character is a
+    // space).
+    // Best reference I could find:
+    //   https://keithp.com/~keithp/render/Xft.tutorial
+    // Visible bounding box: [-x, -x + width[
+    // Logical bounding box: [0, xOff[
+    // For centering we should always use the logical bounding box, however for
+    // erasing we should use the visible bounding box. Thus our goal is to
+    // expand the _logical_ box to fully cover the _visible_ box:
+    int expand_left = extents.x;
+    int expand_right = -extents.x + extents.width - extents.xOff;
+    int expand_max = expand_left > expand_right ? expand_left : expand_right;
+    return expand_max > 0 ? expand_max : 0;
+  }
+#else
+  (void)display;
+  (void)font;
+  (void)string;
+  (void)len;
+#endif
+  // Core fonts are drawn within their logical box.
+  return 0;
+}
+
+void DrawText(Display *display, const struct Font *font,
+              const struct TextPen *pen, int x, int y, const char *string,
+              int len) {
+#ifdef HAVE_XFT_EXT
+  if (font->xft_font != NULL) {
+    XftDrawStringUtf8(pen->xft_draw, pen->xft_color, font->xft_font, x, y,
+                      (const FcChar8 *)string, len);
+    return;
+  }
+#else
+  (void)font;
+#endif
+  XDrawString(display, pen->drawable, pen->gc, x, y, string, len);
+}
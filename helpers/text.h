@@ -0,0 +1,88 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <X11/X.h>     // for Drawable
+#include <X11/Xlib.h>  // for Display, GC, XFontStruct
+
+#ifdef HAVE_XFT_EXT
+#include <X11/Xft/Xft.h>  // for XftColor, XftDraw, XftFont
+#endif
+
+//! A font to draw text in; exactly one of the members is set.
+struct Font {
+  XFontStruct *core_font;
+#ifdef HAVE_XFT_EXT
+  XftFont *xft_font;
+#endif
+};
+
+//! Where to draw text, and in which color.
+struct TextPen {
+  //! The drawable for the core font.
+  Drawable drawable;
+  //! The GC for the core font; its font must be set to the core font.
+  GC gc;
+#ifdef HAVE_XFT_EXT
+  //! The draw and color for the Xft font.
+  XftDraw *xft_draw;
+  XftColor *xft_color;
+#endif
+};
+
+/*! \brief Loads the font given by $XSECURELOCK_FONT, or a fallback font.
+ *
+ * The name is tried as an X11 core font first, then as an Xft font. If neither
+ * works, "monospace" and finally "fixed" are used.
+ *
+ * \param display The display to load the font on.
+ * \param name The font name; may be empty to use the default font.
+ * \param pixel_size If positive, the size to scale Xft fonts to; otherwise the
+ *   size from the font name is used. X11 core fonts can't be scaled.
+ * \param font Receives the font.
+ * \return Whether any font could be loaded.
+ */
+int LoadFont(Display *display, const char *name, int pixel_size,
+             struct Font *font);
+
+/*! \brief Frees a font loaded by LoadFont.
+ */
+void FreeFont(Display *display, struct Font *font);
+
+int TextAscent(const struct Font *font);
+
+int TextDescent(const struct Font *font);
+
+/*! \brief Returns the advance width of a string, i.e. its logical width.
+ */
+int TextAdvance(Display *display, const struct Font *font, const char *string,
+                int len);
+
+/*! \brief Returns how far the drawn glyphs of a string may extend beyond its
+ * logical box on either side.
+ */
+int TextExpandAmount(Display *display, const struct Font *font,
+                     const char *string, int len);
+
+/*! \brief Draws a string with its baseline starting at (x, y).
+ */
+void DrawText(Display *display, const struct Font *font,
+              const struct TextPen *pen, int x, int y, const char *string,
+              int len);
+
+#endif
@@ -31,35 +31,15 @@ limitations under the License.
 #include <signal.h>    // for sigaction, raise, sigemptyset
 #include <stdint.h>    // for uint64_t
 #include <stdlib.h>    // for NULL, size_t, EXIT_FAILURE
-#include <string.h>    // for memcpy, NULL, strcmp, strcspn
 #include <sys/time.h>  // for gettimeofday, timeval
 #include <time.h>      // for nanosleep, timespec
 #include <unistd.h>    // for _exit, execvp, fork, setsid
 
-#ifdef HAVE_XSCREENSAVER_EXT
-#include <X11/extensions/scrnsaver.h>  // for XScreenSaverAllocInfo, XScreen...
-#endif
-
-#ifdef HAVE_XSYNC_EXT
-#include <X11/extensions/sync.h>       // for XSyncSystemCounter, XSyncListS...
-#include <X11/extensions/syncconst.h>  // for XSyncValue
-#endif
-
-#include "../env_settings.h"  // for GetIntSetting, GetStringSetting
-#include "../logging.h"       // for Log, LogErrno
+#include "../env_settings.h"  // for GetIntSetting
+#include "../idle_time.h"     // for GetIdleTime, InitIdleTime
+#include "../logging.h"       // for Log, LogErrno, FinishLog
 #include "../wait_pgrp.h"     // for KillPgrp, WaitPgrp
 
-#ifdef HAVE_XSCREENSAVER_EXT
-int have_xscreensaver_ext;
-XScreenSaverInfo *saver_info;
-#endif
-
-#ifdef HAVE_XSYNC_EXT
-int have_xsync_ext;
-int num_xsync_counters;
-XSyncSystemCounter *xsync_counters;
-#endif
-
 pid_t childpid = 0;
 
 static void HandleSIGTERM(int signo) {
@@ -69,64 +49,6 @@ static void HandleSIGTERM(int signo) {
   raise(signo);
 }
 
-uint64_t GetIdleTimeForSingleTimer(Display *display, Window w,
-                                   const char *timer) {
-  if (*timer == 0) {
-#ifdef HAVE_XSCREENSAVER_EXT
-    if (have_xscreensaver_ext) {
-      XScreenSaverQueryInfo(display, w, saver_info);
-      return saver_info->idle;
-    }
-#endif
-  } else {
-#ifdef HAVE_XSYNC_EXT
-    if (have_xsync_ext) {
-      int i;
-      for (i = 0; i < num_xsync_counters; ++i) {
-        if (!strcmp(timer,
-                    xsync_counters[i].name)) {  // I know this is inefficient.
-          XSyncValue value;
-          XSyncQueryCounter(display, xsync_counters[i].counter, &value);
-          return (((uint64_t)XSyncValueHigh32(value)) << 32) |
-                 (uint64_t)XSyncValueLow32(value);
-        }
-      }
-    }
-#endif
-  }
-  Log("Timer \"%s\" not supported", timer);
-  (void)display;
-  (void)w;
-  return (uint64_t)-1;
-}
-
-uint64_t GetIdleTime(Display *display, Window w, const char *timers) {
-  uint64_t min_idle_time = (uint64_t)-1;
-  for (;;) {
-    size_t len = strcspn(timers, ",");
-    if (timers[len] == 0) {  // End of string.
-      uint64_t this_idle_time = GetIdleTimeForSingleTimer(display, w, timers);
-      if (this_idle_time < min_idle_time) {
-        min_idle_time = this_idle_time;
-      }
-      return min_idle_time;
-    }
-    char this_timer[64];
-    if (len < sizeof(this_timer)) {
-      memcpy(this_timer, timers, len);
-      this_timer[len] = 0;
-      uint64_t this_idle_time =
-          GetIdleTimeForSingleTimer(display, w, this_timer);
-      if (this_idle_time < min_idle_time) {
-        min_idle_time = this_idle_time;
-      }
-    } else {
-      Log("Too long timer name - skipping: %s", timers);
-    }
-    timers += len + 1;
-  }
-}
-
 int main(int argc, char **argv) {
   if (argc <= 1) {
     Log("Usage: %s program args... - runs the given program until non-idle",
@@ -139,13 +61,6 @@ int main(int argc, char **argv) {
 
   int dim_time_ms = GetIntSetting("XSECURELOCK_DIM_TIME_MS", 2000);
   int wait_time_ms = GetIntSetting("XSECURELOCK_WAIT_TIME_MS", 5000);
-  const char *timers = GetStringSetting("XSECURELOCK_IDLE_TIMERS",
-#ifdef HAVE_XSCREENSAVER_EXT
-                                        ""
-#else
-                                        "IDLETIME"
-#endif
-  );
 
   Display *display = XOpenDisplay(NULL);
   if (display == NULL) {
@@ -155,26 +70,10 @@ int main(int argc, char **argv) {
   Window root_window = DefaultRootWindow(display);
 
   // Initialize the extensions.
-#ifdef HAVE_XSCREENSAVER_EXT
-  have_xscreensaver_ext = 0;
-  int scrnsaver_event_base, scrnsaver_error_base;
-  if (XScreenSaverQueryExtension(display, &scrnsaver_event_base,
-                                 &scrnsaver_error_base)) {
-    have_xscreensaver_ext = 1;
-    saver_info = XScreenSaverAllocInfo();
-  }
-#endif
-#ifdef HAVE_XSYNC_EXT
-  have_xsync_ext = 0;
-  int sync_event_base, sync_error_base;
-  if (XSyncQueryExtension(display, &sync_event_base, &sync_error_base)) {
-    have_xsync_ext = 1;
-    xsync_counters = XSyncListSystemCounters(display, &num_xsync_counters);
-  }
-#endif
+  InitIdleTime(display);
 
   // Capture the initial idle time.
-  uint64_t prev_idle = GetIdleTime(display, root_window, timers);
+  uint64_t prev_idle = GetIdleTime(display, root_window);
   if (prev_idle == (uint64_t)-1) {
     Log("Could not initialize idle timers. Bailing out.");
     return 1;
@@ -191,6 +90,7 @@ int main(int argc, char **argv) {
     StartPgrp();
     execvp(argv[1], argv + 1);
     LogErrno("execl");
+    FinishLog();
     _exit(EXIT_FAILURE);
   }
 
@@ -211,7 +111,7 @@ int main(int argc, char **argv) {
   while (childpid != 0) {
     nanosleep(&(const struct timespec){0, 10000000L}, NULL);  // 10ms.
 
-    uint64_t cur_idle = GetIdleTime(display, root_window, timers);
+    uint64_t cur_idle = GetIdleTime(display, root_window);
     still_idle = cur_idle >= prev_idle;
     prev_idle = cur_idle;
 
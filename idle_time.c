@@ -0,0 +1,133 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "idle_time.h"
+
+#include <string.h>  // for memcpy, strcmp, strcspn
+
+#ifdef HAVE_XSCREENSAVER_EXT
+#include <X11/extensions/scrnsaver.h>  // for XScreenSaverAllocInfo, XScreen...
+#endif
+
+#ifdef HAVE_XSYNC_EXT
+#include <X11/extensions/sync.h>       // for XSyncSystemCounter, XSyncListS...
+#include <X11/extensions/syncconst.h>  // for XSyncValue
+#endif
+
+#include "env_settings.h"  // for GetStringSetting
+#include "logging.h"       // for Log
+
+#ifdef HAVE_XSCREENSAVER_EXT
+static int have_xscreensaver_ext;
+static XScreenSaverInfo *saver_info;
+#endif
+
+#ifdef HAVE_XSYNC_EXT
+static int have_xsync_ext;
+static int num_xsync_counters;
+static XSyncSystemCounter *xsync_counters;
+#endif
+
+//! The comma separated list of timers to query.
+static const char *idle_timers;
+
+void InitIdleTime(Display *display) {
+  idle_timers = GetStringSetting("XSECURELOCK_IDLE_TIMERS",
+#ifdef HAVE_XSCREENSAVER_EXT
+                                 ""
+#else
+                                 "IDLETIME"
+#endif
+  );
+
+#ifdef HAVE_XSCREENSAVER_EXT
+  have_xscreensaver_ext = 0;
+  int scrnsaver_event_base, scrnsaver_error_base;
+  if (XScreenSaverQueryExtension(display, &scrnsaver_event_base,
+                                 &scrnsaver_error_base)) {
+    have_xscreensaver_ext = 1;
+    saver_info = XScreenSaverAllocInfo();
+  }
+#endif
+#ifdef HAVE_XSYNC_EXT
+  have_xsync_ext = 0;
+  int sync_event_base, sync_error_base;
+  if (XSyncQueryExtension(display, &sync_event_base, &sync_error_base)) {
+    have_xsync_ext = 1;
+    xsync_counters = XSyncListSystemCounters(display, &num_xsync_counters);
+  }
+#endif
+  (void)display;
+}
+
+static uint64_t GetIdleTimeForSingleTimer(Display *display, Window w,
+                                          const char *timer) {
+  if (*timer == 0) {
+#ifdef HAVE_XSCREENSAVER_EXT
+    if (have_xscreensaver_ext) {
+      XScreenSaverQueryInfo(display, w, saver_info);
+      return saver_info->idle;
+    }
+#endif
+  } else {
+#ifdef HAVE_XSYNC_EXT
+    if (have_xsync_ext) {
+      int i;
+      for (i = 0; i < num_xsync_counters; ++i) {
+        if (!strcmp(timer,
+                    xsync_counters[i].name)) {  // I know this is inefficient.
+          XSyncValue value;
+          XSyncQueryCounter(display, xsync_counters[i].counter, &value);
+          return (((uint64_t)XSyncValueHigh32(value)) << 32) |
+                 (uint64_t)XSyncValueLow32(value);
+        }
+      }
+    }
+#endif
+  }
+  Log("Timer \"%s\" not supported", timer);
+  (void)display;
+  (void)w;
+  return (uint64_t)-1;
+}
+
+uint64_t GetIdleTime(Display *display, Window w) {
+  const char *timers = idle_timers;
+  uint64_t min_idle_time = (uint64_t)-1;
+  for (;;) {
+    size_t len = strcspn(timers, ",");
+    if (timers[len] == 0) {  // End of string.
+      uint64_t this_idle_time = GetIdleTimeForSingleTimer(display, w, timers);
+      if (this_idle_time < min_idle_time) {
+        min_idle_time = this_idle_time;
+      }
+      return min_idle_time;
+    }
+    char this_timer[64];
+    if (len < sizeof(this_timer)) {
+      memcpy(this_timer, timers, len);
+      this_timer[len] = 0;
+      uint64_t this_idle_time =
+          GetIdleTimeForSingleTimer(display, w, this_timer);
+      if (this_idle_time < min_idle_time) {
+        min_idle_time = this_idle_time;
+      }
+    } else {
+      Log("Too long timer name - skipping: %s", timers);
+    }
+    timers += len + 1;
+  }
+}
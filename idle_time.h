@@ -0,0 +1,39 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef IDLE_TIME_H
+#define IDLE_TIME_H
+
+#include <X11/X.h>     // for Window
+#include <X11/Xlib.h>  // for Display
+#include <stdint.h>    // for uint64_t
+
+/*! \brief Initializes the X11 extensions needed to query idle time.
+ *
+ * The timers to use are read from XSECURELOCK_IDLE_TIMERS.
+ */
+void InitIdleTime(Display *display);
+
+/*! \brief Returns the current idle time.
+ *
+ * \param display The X11 display.
+ * \param w The window to query idle time for (usually the root window).
+ * \return The minimum idle time of all configured timers in milliseconds, or
+ *   (uint64_t)-1 if none of them are supported.
+ */
+uint64_t GetIdleTime(Display *display, Window w);
+
+#endif
@@ -0,0 +1,154 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "key_commands.h"
+
+#include <X11/X.h>     // for KeySym, NoSymbol
+#include <X11/Xlib.h>  // for XStringToKeysym
+#include <stdlib.h>    // for bsearch, qsort, EXIT_FAILURE
+#include <string.h>    // for strchr, strncmp, strlen, strstr, memcpy
+#include <time.h>      // for clock_gettime, timespec, CLOCK_MONOTONIC
+#include <unistd.h>    // for pid_t, _exit, execl
+
+#include "logging.h"    // for Log, LogErrno, FinishLog
+#include "wait_pgrp.h"  // for ForkWithoutSigHandlers, WaitProc
+
+extern char **environ;
+
+//! The maximum number of key bindings.
+#define MAX_KEY_COMMANDS 64
+
+//! The minimum time between two runs of the same key's command.
+#define KEY_COMMAND_MIN_INTERVAL_MS 100
+
+//! The name of the key command settings; %s is the name of the keysym.
+static const char key_command_setting[] = "XSECURELOCK_KEY_%s_COMMAND";
+
+struct KeyCommand {
+  //! The key this command is bound to.
+  KeySym keysym;
+  //! The shell command to run; points into the environment.
+  const char *command;
+  //! The PID of the running command, or 0.
+  pid_t pid;
+  //! When the command was last started (CLOCK_MONOTONIC).
+  struct timespec last_run;
+};
+
+//! The key bindings, sorted by keysym.
+static struct KeyCommand key_commands[MAX_KEY_COMMANDS];
+
+//! The number of key bindings.
+static size_t num_key_commands = 0;
+
+static int CompareKeyCommands(const void *a, const void *b) {
+  KeySym ka = ((const struct KeyCommand *)a)->keysym;
+  KeySym kb = ((const struct KeyCommand *)b)->keysym;
+  return (ka > kb) - (ka < kb);
+}
+
+void InitKeyCommands(void) {
+  const char *suffix = strstr(key_command_setting, "%s") + 2;
+  size_t prefix_len = suffix - 2 - key_command_setting;
+  size_t suffix_len = strlen(suffix);
+  char **env;
+  for (env = environ; *env != NULL; ++env) {
+    if (strncmp(*env, key_command_setting, prefix_len)) {
+      continue;
+    }
+    const char *name = *env + prefix_len;
+    const char *eq = strchr(name, '=');
+    if (eq == NULL || *(eq + 1) == 0 || (size_t)(eq - name) <= suffix_len ||
+        strncmp(eq - suffix_len, suffix, suffix_len)) {
+      continue;
+    }
+    char keyname[64];
+    size_t keyname_len = eq - name - suffix_len;
+    if (keyname_len >= sizeof(keyname)) {
+      Log("Wow, pretty long keysym names you got there");
+      continue;
+    }
+    memcpy(keyname, name, keyname_len);
+    keyname[keyname_len] = 0;
+    KeySym keysym = XStringToKeysym(keyname);
+    if (keysym == NoSymbol) {
+      Log("Ignoring command for unknown key %s", keyname);
+      continue;
+    }
+    if (num_key_commands >= MAX_KEY_COMMANDS) {
+      Log("Too many key commands; ignoring the one for %s", keyname);
+      continue;
+    }
+    key_commands[num_key_commands].keysym = keysym;
+    key_commands[num_key_commands].command = eq + 1;
+    key_commands[num_key_commands].pid = 0;
+    ++num_key_commands;
+  }
+  qsort(key_commands, num_key_commands, sizeof(*key_commands),
+        CompareKeyCommands);
+}
+
+int RunKeyCommand(KeySym keysym) {
+  struct KeyCommand key;
+  key.keysym = keysym;
+  struct KeyCommand *cmd =
+      bsearch(&key, key_commands, num_key_commands, sizeof(*key_commands),
+              CompareKeyCommands);
+  if (cmd == NULL) {
+    return 0;
+  }
+
+  if (cmd->pid != 0) {
+    int status;
+    if (!WaitProc("key command", &cmd->pid, 0, 0, &status)) {
+      // Still running; don't pile up more instances.
+      return 1;
+    }
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long since_last_ms = (now.tv_sec - cmd->last_run.tv_sec) * 1000L +
+                       (now.tv_nsec - cmd->last_run.tv_nsec) / 1000000L;
+  if (since_last_ms < KEY_COMMAND_MIN_INTERVAL_MS) {
+    return 1;
+  }
+
+  pid_t pid = ForkWithoutSigHandlers();
+  if (pid == -1) {
+    LogErrno("fork");
+  } else if (pid == 0) {
+    // Child process.
+    execl("/bin/sh", "sh", "-c", cmd->command, NULL);
+    LogErrno("execl");
+    FinishLog();
+    _exit(EXIT_FAILURE);
+  } else {
+    // Parent process after successful fork.
+    cmd->pid = pid;
+    cmd->last_run = now;
+  }
+  return 1;
+}
+
+void WaitKeyCommands(void) {
+  size_t i;
+  for (i = 0; i < num_key_commands; ++i) {
+    if (key_commands[i].pid != 0) {
+      int status;
+      WaitProc("key command", &key_commands[i].pid, 0, 0, &status);
+    }
+  }
+}
@@ -0,0 +1,44 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef KEY_COMMANDS_H
+#define KEY_COMMANDS_H
+
+#include <X11/X.h>  // for KeySym
+
+/*! \brief Loads all XSECURELOCK_KEY_%s_COMMAND settings.
+ *
+ * The environment is only scanned once; later changes are not picked up.
+ */
+void InitKeyCommands(void);
+
+/*! \brief Runs the command bound to the given key, if any.
+ *
+ * Commands are not run again while their previous instance is still running,
+ * or if it was started only very recently (i.e. due to key repeat).
+ *
+ * \param keysym The key that was pressed.
+ * \return True if a command is bound to the key, even if it was not run now.
+ */
+int RunKeyCommand(KeySym keysym);
+
+/*! \brief Reaps key commands that have exited.
+ *
+ * Call this regularly; it does not block.
+ */
+void WaitKeyCommands(void);
+
+#endif
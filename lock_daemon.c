@@ -0,0 +1,239 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "lock_daemon.h"
+
+#include <errno.h>       // for errno, EINTR, ENOENT
+#include <fcntl.h>       // for fcntl, FD_CLOEXEC, F_GETFD, F_SETFD
+#include <stdio.h>       // for snprintf
+#include <string.h>      // for memset, strlen, memcpy, strchr
+#include <sys/socket.h>  // for socket, bind, listen, accept, connect
+#include <sys/stat.h>    // for umask, chmod
+#include <sys/un.h>      // for sockaddr_un
+#include <unistd.h>      // for close, read, write, unlink
+
+#include "env_settings.h"  // for GetStringSetting
+#include "logging.h"       // for Log, LogErrno
+
+//! Maximum number of clients waiting for the same lock.
+#define MAX_LOCK_CLIENTS 8
+
+//! The connected clients.
+static int lock_client_fds[MAX_LOCK_CLIENTS];
+
+//! The number of connected clients.
+static int num_lock_clients = 0;
+
+static void SetCloseOnExec(int fd) {
+  int flags = fcntl(fd, F_GETFD);
+  if (flags == -1 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1) {
+    LogErrno("fcntl(FD_CLOEXEC)");
+  }
+}
+
+/*! \brief Computes the address of the control socket.
+ *
+ * \return True if the address could be determined.
+ */
+static int GetLockDaemonAddress(struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  const char *path = GetStringSetting("XSECURELOCK_DAEMON_SOCKET", "");
+  int len;
+  if (*path) {
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s", path);
+  } else {
+    const char *runtime_dir = GetStringSetting("XDG_RUNTIME_DIR", "");
+    if (!*runtime_dir) {
+      Log("Neither XSECURELOCK_DAEMON_SOCKET nor XDG_RUNTIME_DIR are set");
+      return 0;
+    }
+    const char *display = GetStringSetting("DISPLAY", "");
+    if (!*display || strchr(display, '/') != NULL) {
+      Log("DISPLAY is not suitable for naming the daemon socket. Set "
+          "XSECURELOCK_DAEMON_SOCKET instead");
+      return 0;
+    }
+    len = snprintf(addr->sun_path, sizeof(addr->sun_path),
+                   "%s/xsecurelock-%s.sock", runtime_dir, display);
+  }
+  if (len <= 0 || (size_t)len >= sizeof(addr->sun_path)) {
+    Log("Daemon socket path is too long");
+    return 0;
+  }
+  return 1;
+}
+
+/*! \brief Connects to the control socket.
+ *
+ * \return The connected socket, or -1 on failure; errno is then set.
+ */
+static int ConnectLockDaemon(const struct sockaddr_un *addr) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == -1) {
+    int errno_save = errno;
+    close(fd);
+    errno = errno_save;
+    return -1;
+  }
+  return fd;
+}
+
+int ListenForLockRequests(void) {
+  struct sockaddr_un addr;
+  if (!GetLockDaemonAddress(&addr)) {
+    return -1;
+  }
+
+  // Refuse to steal the socket of a daemon that is still running; otherwise
+  // remove the stale socket of a previous instance.
+  int other = ConnectLockDaemon(&addr);
+  if (other != -1) {
+    close(other);
+    Log("Another lock daemon is already listening on %s", addr.sun_path);
+    return -1;
+  }
+  if (unlink(addr.sun_path) != 0 && errno != ENOENT) {
+    LogErrno("unlink(%s)", addr.sun_path);
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    LogErrno("socket");
+    return -1;
+  }
+  SetCloseOnExec(fd);
+  // Nobody but us may request a lock (or learn when we unlock).
+  mode_t old_umask = umask(077);
+  int status = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+  umask(old_umask);
+  if (status != 0) {
+    LogErrno("bind(%s)", addr.sun_path);
+    close(fd);
+    return -1;
+  }
+  if (chmod(addr.sun_path, 0600) != 0) {
+    LogErrno("chmod(%s)", addr.sun_path);
+    close(fd);
+    return -1;
+  }
+  if (listen(fd, MAX_LOCK_CLIENTS) != 0) {
+    LogErrno("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*! \brief Sends a status byte to a client.
+ *
+ * \return True if sending succeeded.
+ */
+static int SendLockStatus(int fd, char status) {
+  for (;;) {
+    ssize_t n = write(fd, &status, 1);
+    if (n == 1) {
+      return 1;
+    }
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    return 0;
+  }
+}
+
+int AcceptLockRequest(int listen_fd, int locked) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd == -1) {
+    if (errno != EINTR) {
+      LogErrno("accept");
+    }
+    return 0;
+  }
+  SetCloseOnExec(fd);
+  if (num_lock_clients >= MAX_LOCK_CLIENTS) {
+    Log("Too many lock clients, dropping one");
+    close(fd);
+    return 0;
+  }
+  if (locked && !SendLockStatus(fd, LOCK_DAEMON_LOCKED)) {
+    close(fd);
+    return 0;
+  }
+  lock_client_fds[num_lock_clients++] = fd;
+  return 1;
+}
+
+void NotifyLockClients(char status) {
+  int i, j;
+  for (i = 0, j = 0; i < num_lock_clients; ++i) {
+    // Clients that went away are only noticed here; just forget them.
+    if (SendLockStatus(lock_client_fds[i], status) &&
+        status != LOCK_DAEMON_UNLOCKED) {
+      lock_client_fds[j++] = lock_client_fds[i];
+    } else {
+      close(lock_client_fds[i]);
+    }
+  }
+  num_lock_clients = j;
+}
+
+void DropLockClients(void) {
+  int i;
+  for (i = 0; i < num_lock_clients; ++i) {
+    close(lock_client_fds[i]);
+  }
+  num_lock_clients = 0;
+}
+
+int RequestLockFromDaemon(void) {
+  struct sockaddr_un addr;
+  if (!GetLockDaemonAddress(&addr)) {
+    return -1;
+  }
+  int fd = ConnectLockDaemon(&addr);
+  if (fd == -1) {
+    LogErrno("Could not connect to the lock daemon at %s", addr.sun_path);
+    return -1;
+  }
+  SetCloseOnExec(fd);
+  return fd;
+}
+
+int WaitForLockDaemon(int fd, char status) {
+  for (;;) {
+    char c;
+    ssize_t n = read(fd, &c, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      LogErrno("read from lock daemon");
+      return 0;
+    }
+    if (n == 0) {
+      Log("Lock daemon closed the connection");
+      return 0;
+    }
+    if (c == status) {
+      return 1;
+    }
+  }
+}
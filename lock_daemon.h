@@ -0,0 +1,77 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef LOCK_DAEMON_H
+#define LOCK_DAEMON_H
+
+//! Sent by the daemon once the screen is locked.
+#define LOCK_DAEMON_LOCKED 'L'
+
+//! Sent by the daemon once the screen has been unlocked again.
+#define LOCK_DAEMON_UNLOCKED 'U'
+
+/*! \brief Creates the control socket of the lock daemon.
+ *
+ * The socket is created with mode 0600 at $XSECURELOCK_DAEMON_SOCKET, or by
+ * default in $XDG_RUNTIME_DIR with a name derived from $DISPLAY.
+ *
+ * Possible errors will be printed on stderr.
+ *
+ * \return The listening socket, or -1 on failure.
+ */
+int ListenForLockRequests(void);
+
+/*! \brief Accepts a pending lock request on the control socket.
+ *
+ * \param listen_fd The socket returned by ListenForLockRequests().
+ * \param locked Whether the screen already is locked; if so, the client is
+ *   told so right away.
+ * \return True if a client was accepted.
+ */
+int AcceptLockRequest(int listen_fd, int locked);
+
+/*! \brief Tells all connected clients about a change of the lock state.
+ *
+ * After LOCK_DAEMON_UNLOCKED, all clients are disconnected.
+ *
+ * \param status LOCK_DAEMON_LOCKED or LOCK_DAEMON_UNLOCKED.
+ */
+void NotifyLockClients(char status);
+
+/*! \brief Disconnects all clients without telling them about an unlock.
+ *
+ * Clients treat this as a failure to lock.
+ */
+void DropLockClients(void);
+
+/*! \brief Sends a lock request to a running lock daemon.
+ *
+ * Possible errors will be printed on stderr.
+ *
+ * \return The connection to the daemon, or -1 on failure.
+ */
+int RequestLockFromDaemon(void);
+
+/*! \brief Waits for the lock daemon to report the given state.
+ *
+ * \param fd The connection returned by RequestLockFromDaemon().
+ * \param status The state to wait for.
+ * \return True if the daemon reported the given state, false if the
+ *   connection was lost before.
+ */
+int WaitForLockDaemon(int fd, char status);
+
+#endif
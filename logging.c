@@ -1,40 +1,245 @@
 #include "logging.h"
 
-#include <errno.h>   // for errno
+#include <errno.h>   // for errno, EINTR, EAGAIN
+#include <poll.h>    // for poll, pollfd, POLLOUT
+#include <signal.h>  // for sig_atomic_t
 #include <stdarg.h>  // for va_end, va_list, va_start
-#include <stdio.h>   // for fputs, stderr, vfprintf, perror, NULL
+#include <stdio.h>   // for vsnprintf, NULL
+#include <stdlib.h>  // for atexit
+#include <string.h>  // for strerror
 #include <time.h>
 #include <unistd.h>
 
-static void PrintLogPrefix(void) {
+/*! \brief Maximum length of a single log line, including prefix and newline.
+ *
+ * Must not exceed PIPE_BUF, so that writing a line to a pipe that poll()
+ * reported as writable never blocks.
+ */
+#define LOG_LINE_SIZE 512
+
+//! Number of log lines that can be queued before messages get dropped.
+#define LOG_RING_SIZE 64
+
+//! A single formatted log line waiting to be written to stderr.
+struct LogLine {
+  //! The process that logged this line (lines inherited via fork are skipped).
+  pid_t pid;
+  //! Length of the text.
+  size_t len;
+  //! The text, including the trailing newline. Not NUL terminated.
+  char text[LOG_LINE_SIZE];
+};
+
+//! The preallocated ring of log lines.
+static struct LogLine log_ring[LOG_RING_SIZE];
+
+//! Number of lines ever queued (the next line goes to log_head % size).
+static size_t log_head = 0;
+
+//! Number of lines ever written out (the next line to write is at log_tail).
+static size_t log_tail = 0;
+
+//! How much of the line at log_tail has already been written.
+static size_t log_tail_written = 0;
+
+//! Number of messages dropped because the ring was full.
+static unsigned long log_dropped = 0;
+
+//! Set while we're inside a logging function (e.g. to detect signal handlers).
+static volatile sig_atomic_t log_busy = 0;
+
+//! Whether the exit handler has been installed.
+static int log_atexit_installed = 0;
+
+static void AppendLogText(struct LogLine *line, const char *format,
+                          va_list args) {
+  size_t space = sizeof(line->text) - line->len;
+  int n = vsnprintf(line->text + line->len, space, format, args);
+  if (n < 0) {
+    return;
+  }
+  if ((size_t)n >= space) {
+    // Truncated. Leave the last byte for the newline.
+    line->len = sizeof(line->text) - 1;
+  } else {
+    line->len += n;
+  }
+}
+
+static void AppendLogString(struct LogLine *line, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+static void AppendLogString(struct LogLine *line, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  AppendLogText(line, format, args);
+  va_end(args);
+}
+
+static void FormatLogPrefix(struct LogLine *line) {
   time_t t = time(NULL);
   struct tm tm_buf;
   struct tm *tm = gmtime_r(&t, &tm_buf);
   char s[32];
-  if (!strftime(s, sizeof(s), "%Y-%m-%dT%H:%M:%SZ ", tm)) {
+  if (tm == NULL || !strftime(s, sizeof(s), "%Y-%m-%dT%H:%M:%SZ ", tm)) {
     *s = 0;
   }
-  fprintf(stderr, "%s%ld xsecurelock: ", s, (long)getpid());
+  line->len = 0;
+  AppendLogString(line, "%s%ld xsecurelock: ", s, (long)line->pid);
+}
+
+/*! \brief Writes out queued log lines.
+ *
+ * \param do_block If false, stop as soon as stderr isn't writable.
+ */
+static void WriteLogRing(int do_block) {
+  pid_t self = getpid();
+  while (log_tail != log_head) {
+    struct LogLine *line = &log_ring[log_tail % LOG_RING_SIZE];
+    if (line->pid != self) {
+      // Inherited from our parent via fork(); the parent writes it itself.
+      ++log_tail;
+      log_tail_written = 0;
+      continue;
+    }
+    if (!do_block) {
+      struct pollfd pfd;
+      pfd.fd = 2;
+      pfd.events = POLLOUT;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLOUT | POLLERR))) {
+        return;
+      }
+    }
+    ssize_t n = write(2, line->text + log_tail_written,
+                      line->len - log_tail_written);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN && !do_block) {
+        return;
+      }
+      // Nowhere to log to. Drop the line rather than spinning.
+      n = line->len - log_tail_written;
+    }
+    log_tail_written += n;
+    if (log_tail_written >= line->len) {
+      ++log_tail;
+      log_tail_written = 0;
+    }
+  }
+}
+
+/*! \brief Queues a new log line in the ring buffer.
+ *
+ * \return The line to fill in, or NULL if the ring is full.
+ */
+static struct LogLine *NewLogLine(void) {
+  if (log_head - log_tail >= LOG_RING_SIZE) {
+    WriteLogRing(0);
+    if (log_head - log_tail >= LOG_RING_SIZE) {
+      ++log_dropped;
+      return NULL;
+    }
+  }
+  struct LogLine *line = &log_ring[log_head % LOG_RING_SIZE];
+  line->pid = getpid();
+  FormatLogPrefix(line);
+  return line;
+}
+
+void FinishLog(void) {
+  if (log_busy) {
+    return;
+  }
+  log_busy = 1;
+  WriteLogRing(1);
+  log_busy = 0;
+}
+
+/*! \brief Common entry code of all logging functions.
+ *
+ * \return Zero if logging must be skipped (reentrant call).
+ */
+static int BeginLog(void) {
+  if (log_busy) {
+    // Called from a signal handler while logging. Can't touch the ring.
+    ++log_dropped;
+    return 0;
+  }
+  log_busy = 1;
+  if (!log_atexit_installed) {
+    log_atexit_installed = 1;
+    atexit(FinishLog);
+  }
+  if (log_dropped != 0 && log_head - log_tail < LOG_RING_SIZE) {
+    struct LogLine *line = NewLogLine();
+    if (line != NULL) {
+      AppendLogString(line, "Dropped %lu log messages.\n", log_dropped);
+      if (line->text[line->len - 1] != '\n') {
+        line->text[line->len++] = '\n';
+      }
+      ++log_head;
+      log_dropped = 0;
+    }
+  }
+  return 1;
+}
+
+static void EndLog(struct LogLine *line) {
+  if (line != NULL) {
+    if (line->len == 0 || line->text[line->len - 1] != '\n') {
+      line->text[line->len++] = '\n';
+    }
+    ++log_head;
+  }
+  WriteLogRing(0);
+  log_busy = 0;
 }
 
 void Log(const char *format, ...) {
-  va_list args;
-  va_start(args, format);
-  PrintLogPrefix();
-  vfprintf(stderr, format, args);
-  fputs(".\n", stderr);
-  va_end(args);
+  int errno_save = errno;
+  if (!BeginLog()) {
+    errno = errno_save;
+    return;
+  }
+  struct LogLine *line = NewLogLine();
+  if (line != NULL) {
+    va_list args;
+    va_start(args, format);
+    AppendLogText(line, format, args);
+    va_end(args);
+    AppendLogString(line, ".\n");
+  }
+  EndLog(line);
+  errno = errno_save;
 }
 
 void LogErrno(const char *format, ...) {
   int errno_save = errno;
-  va_list args;
-  va_start(args, format);
-  PrintLogPrefix();
-  vfprintf(stderr, format, args);
-  fputs(": ", stderr);
+  if (!BeginLog()) {
+    errno = errno_save;
+    return;
+  }
+  struct LogLine *line = NewLogLine();
+  if (line != NULL) {
+    va_list args;
+    va_start(args, format);
+    AppendLogText(line, format, args);
+    va_end(args);
+    AppendLogString(line, ": %s\n", strerror(errno_save));
+  }
+  EndLog(line);
   errno = errno_save;
-  perror(NULL);
-  va_end(args);
+}
+
+int FlushLog(void) {
+  int errno_save = errno;
+  if (!log_busy) {
+    log_busy = 1;
+    WriteLogRing(0);
+    log_busy = 0;
+  }
   errno = errno_save;
+  return log_tail != log_head;
 }
@@ -30,8 +30,32 @@ void Log(const char *format, ...) __attribute__((format(printf, 1, 2)));
  * For a format expanding to "Foo", this may log "xsecurelock: Foo: No such
  * file or directory". The value of errno is preserved by this function.
  *
+ * Neither function blocks on a congested stderr. A message that cannot be
+ * queued (buffer full, or a signal handler interrupting another log call) is
+ * dropped and counted.
+ *
  * \param format A printf format string, followed by its arguments.
  */
 void LogErrno(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
+//! How soon to call FlushLog again while messages are pending.
+#define LOG_FLUSH_INTERVAL_MS 100
+
+/*! \brief Writes out log messages that could not be written yet.
+ *
+ * Log messages are queued in a fixed size buffer and only written once stderr
+ * is writable, so logging never blocks. Call this when idle to push out
+ * messages that are still pending. Pending messages are also written at exit.
+ *
+ * \return Whether messages are still pending; if so, don't wait for longer
+ *   than LOG_FLUSH_INTERVAL_MS before calling this again.
+ */
+int FlushLog(void);
+
+/*! \brief Writes out all pending log messages, waiting for stderr if needed.
+ *
+ * Call this before _exit, which skips writing them at exit.
+ */
+void FinishLog(void);
+
 #endif
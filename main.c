@@ -27,14 +27,16 @@ limitations under the License.
 #include <X11/Xutil.h>       // for XLookupString
 #include <X11/cursorfont.h>  // for XC_arrow
 #include <X11/keysym.h>      // for XK_BackSpace, XK_Tab, XK_o
+#include <errno.h>           // for errno, EINTR
 #include <fcntl.h>           // for fcntl, FD_CLOEXEC, F_GETFD
 #include <locale.h>          // for NULL, setlocale, LC_CTYPE
 #include <signal.h>          // for sigaction, raise, sa_handler
+#include <stdint.h>          // for uint64_t
 #include <stdio.h>           // for printf, size_t, snprintf
 #include <stdlib.h>          // for exit, system, EXIT_FAILURE
 #include <string.h>          // for memset, strcmp, strncmp
 #include <sys/select.h>      // for select, timeval, fd_set, FD_SET
-#include <time.h>            // for nanosleep, timespec
+#include <time.h>            // for nanosleep, timespec, clock_gettime
 #include <unistd.h>          // for _exit, chdir, close, execvp
 
 #ifdef HAVE_XCOMPOSITE_EXT
@@ -52,16 +54,24 @@ limitations under the License.
 #include <X11/extensions/shapeconst.h>  // for ShapeBounding
 #endif
 
-#include "auth_child.h"     // for KillAuthChildSigHandler, Want...
-#include "env_settings.h"   // for GetIntSetting, GetExecutableP...
-#include "logging.h"        // for Log, LogErrno
-#include "mlock_page.h"     // for MLOCK_PAGE
-#include "saver_child.h"    // for WatchSaverChild, KillAllSaver...
-#include "unmap_all.h"      // for ClearUnmapAllWindowsState
-#include "util.h"           // for explicit_bzero
-#include "version.h"        // for git_version
-#include "wait_pgrp.h"      // for WaitPgrp
-#include "wm_properties.h"  // for SetWMProperties
+#include "auth_child.h"         // for KillAuthChildSigHandler, Want...
+#include "background_effect.h"  // for CreateBackgroundEffectPixmap
+#include "dim_effect.h"         // for DimEffect, InitDimEffect
+#include "env_settings.h"       // for GetIntSetting, GetExecutableP...
+#include "helpers/monitors.h"   // for PublishMonitors, IsMonitorChan...
+#include "idle_time.h"          // for GetIdleTime, InitIdleTime
+#include "key_commands.h"       // for InitKeyCommands, RunKeyCommand
+#include "lock_daemon.h"        // for ListenForLockRequests, AcceptLo...
+#include "logging.h"            // for Log, LogErrno, FlushLog, FinishLog
+#include "mlock_page.h"         // for MLOCK_PAGE
+#include "saver_cgroup.h"       // for InitSaverCgroup, SaverCgroupOve...
+#include "saver_child.h"        // for WatchSaverChild, KillAllSaver...
+#include "session_snapshot.h"   // for SessionSnapshot, ExportSessionS...
+#include "unmap_all.h"          // for ClearUnmapAllWindowsState
+#include "util.h"               // for explicit_bzero
+#include "version.h"            // for git_version
+#include "wait_pgrp.h"          // for WaitPgrp
+#include "wm_properties.h"      // for SetWMProperties
 
 /*! \brief How often (in times per second) to watch child processes.
  *
@@ -69,6 +79,10 @@ limitations under the License.
  */
 #define WATCH_CHILDREN_HZ 10
 
+/*! \brief The saver to fall back to if a saver keeps exceeding its CPU budget.
+ */
+#define FALLBACK_SAVER_EXECUTABLE "saver_blank"
+
 /*! \brief Try to reinstate grabs in regular intervals.
  *
  * This will reinstate the grabs WATCH_CHILDREN_HZ times per second. This
@@ -95,6 +109,15 @@ limitations under the License.
  */
 #undef SHOW_CURSOR_DURING_AUTH
 
+/*! \brief Maximum time to delay starting the saver until the lock is confirmed.
+ *
+ * The saver is only started once our windows are confirmed to be mapped and
+ * visible, so it doesn't delay releasing the sleep lock; if that confirmation
+ * doesn't come (e.g. because a compositor keeps obscuring us), start the saver
+ * after this time anyway.
+ */
+#define SAVER_START_MAX_DELAY_MS 1000
+
 /*! \brief Exhaustive list of all mouse related X11 events.
  *
  * These will be selected for grab. It is important that this contains all
@@ -121,6 +144,9 @@ struct {
 const char *auth_executable;
 //! The name of the saver child to execute, relative to HELPER_PATH.
 const char *saver_executable;
+//! The saver_executable that was configured; it gets replaced by
+//! FALLBACK_SAVER_EXECUTABLE for the rest of a lock if it uses too much CPU.
+const char *configured_saver_executable;
 //! The command to run once screen locking is complete.
 char *const *notify_command = NULL;
 #ifdef HAVE_XCOMPOSITE_EXT
@@ -135,17 +161,56 @@ int have_switch_user_command = 0;
 int force_grab = 0;
 //! If set, print window info about any "conflicting" windows to stderr.
 int debug_window_info = 0;
+//! If set, keep running and lock whenever requested on the control socket.
+int daemon_mode = 0;
+//! If set, do not lock by ourselves but ask the lock daemon to do so.
+int lock_client_mode = 0;
+//! If set, dim the screen first, and only lock if the user stays idle.
+int dim_before_lock = 0;
+//! If set, suspend the saver child while the screen is blanked, not kill it.
+int suspend_saver_on_blank = 0;
 
 //! The PID of a currently running notify command, or 0 if none is running.
 pid_t notify_command_pid = 0;
 
+//! Whether ExportAuthSnapshot has been done.
+int auth_snapshot_exported = 0;
+
+//! When locking was requested (CLOCK_MONOTONIC).
+struct timespec lock_request_time;
+
+//! Set while the dim effect may have changed state outside our windows.
+volatile sig_atomic_t dimming = 0;
+//! A SIGTERM received while dimming, to handle once the dim effect is undone.
+volatile sig_atomic_t dim_interrupted_by = 0;
+
 static void HandleSIGTERM(int signo) {
+  if (dimming) {
+    // Xlib isn't signal safe; let UndoDimEffect take it from here.
+    dim_interrupted_by = signo;
+    return;
+  }
   KillAllSaverChildrenSigHandler(signo);  // Dirty, but quick.
   KillAuthChildSigHandler(signo);         // More dirty.
   explicit_bzero(&priv, sizeof(priv));
   raise(signo);
 }
 
+/*! \brief Do the work once that every auth child would otherwise repeat.
+ *
+ * This is only done right before the first auth child is started, which then
+ * adds its resolved font to the snapshot; font matching needs Xft, which we
+ * don't use here.
+ */
+void ExportAuthSnapshot(Display *display) {
+  struct SessionSnapshot snapshot;
+  InitSessionSnapshot(&snapshot);
+  AllocAuthColors(display, &snapshot.auth_background,
+                  &snapshot.auth_foreground, &snapshot.auth_warning);
+  snapshot.have_auth_colors = 1;
+  ExportSessionSnapshot(&snapshot);
+}
+
 enum WatchChildrenState {
   //! Request saver child.
   WATCH_CHILDREN_NORMAL,
@@ -161,7 +226,8 @@ enum WatchChildrenState {
  * child are running, the saver child will be spawned.
  *
  * If the requested state is WATCH_CHILDREN_SAVER_DISABLED, a possibly running
- * saver child will be killed.
+ * saver child will be killed, or only suspended if suspend_saver_on_blank is
+ * set.
  *
  * If the requested state is WATCH_CHILDREN_FORCE_AUTH, a possibly running saver
  * child will be killed, and an auth child will be spawned.
@@ -181,6 +247,10 @@ int WatchChildren(Display *dpy, Window auth_win, Window saver_win,
   // already running. It may have recently terminated, which we will notice
   // later.
   if (want_auth) {
+    if (state == WATCH_CHILDREN_FORCE_AUTH && !auth_snapshot_exported) {
+      ExportAuthSnapshot(dpy);
+      auth_snapshot_exported = 1;
+    }
     // Actually start the auth child, or notice termination.
     int auth_running;
     if (WatchAuthChild(auth_win, auth_executable,
@@ -201,8 +271,31 @@ int WatchChildren(Display *dpy, Window auth_win, Window saver_win,
   }
 
   // Show the screen saver.
-  WatchSaverChild(dpy, saver_win, 0, saver_executable,
-                  state != WATCH_CHILDREN_SAVER_DISABLED);
+  if (suspend_saver_on_blank) {
+    // Keep the saver around, so it can show up again right away on unblank.
+    int suspend = state == WATCH_CHILDREN_SAVER_DISABLED;
+    if (!suspend) {
+      SuspendSaverChild(0, 0);
+    }
+    WatchSaverChild(dpy, saver_win, 0, saver_executable, 1);
+    if (suspend) {
+      SuspendSaverChild(0, 1);
+    }
+  } else {
+    WatchSaverChild(dpy, saver_win, 0, saver_executable,
+                    state != WATCH_CHILDREN_SAVER_DISABLED);
+  }
+
+  // Replace savers that keep using too much CPU.
+  int usage = SaverCgroupOverBudget();
+  if (usage > 0 && strcmp(saver_executable, FALLBACK_SAVER_EXECUTABLE)) {
+    Log("Saver %s kept using %d%% CPU; falling back to %s for this lock",
+        saver_executable, usage, FALLBACK_SAVER_EXECUTABLE);
+    WatchSaverChild(dpy, saver_win, 0, saver_executable, 0);
+    saver_executable = FALLBACK_SAVER_EXECUTABLE;
+    WatchSaverChild(dpy, saver_win, 0, saver_executable,
+                    state != WATCH_CHILDREN_SAVER_DISABLED);
+  }
 
   // Do not terminate the screen lock.
   return 0;
@@ -253,6 +346,8 @@ void Usage(const char *me) {
       "\n"
       "Usage:\n"
       "  env [variables...] %s [-- command to run when locked]\n"
+      "  env [variables...] %s --daemon [-- command to run when locked]\n"
+      "  %s lock [-- command to run when locked]\n"
       "\n"
       "Environment variables you may set for XSecureLock and its modules:\n"
       "\n"
@@ -270,7 +365,7 @@ void Usage(const char *me) {
       "This software is licensed under the Apache 2.0 License. Details are\n"
       "available at the following location:\n"
       "  " DOCS_PATH "/COPYING\n",
-      me,
+      me, me, me,
       "%s",   // For XSECURELOCK_KEY_%s_COMMAND.
       "%s");  // For XSECURELOCK_KEY_%s_COMMAND's description.
 }
@@ -292,6 +387,9 @@ void LoadDefaults() {
       *GetStringSetting("XSECURELOCK_SWITCH_USER_COMMAND", "");
   force_grab = GetIntSetting("XSECURELOCK_FORCE_GRAB", 0);
   debug_window_info = GetIntSetting("XSECURELOCK_DEBUG_WINDOW_INFO", 0);
+  dim_before_lock = GetIntSetting("XSECURELOCK_DIM_BEFORE_LOCK", 0);
+  suspend_saver_on_blank =
+      GetIntSetting("XSECURELOCK_SAVER_SUSPEND_ON_BLANK", 0);
 }
 
 /*! \brief Parse the command line arguments, or exit in case of failure.
@@ -319,6 +417,14 @@ void ParseArgumentsOrExit(int argc, char **argv) {
       saver_executable = argv[i];
       continue;
     }
+    if (!strcmp(argv[i], "--daemon")) {
+      daemon_mode = 1;
+      continue;
+    }
+    if (!strcmp(argv[i], "lock")) {
+      lock_client_mode = 1;
+      continue;
+    }
     if (!strcmp(argv[i], "--")) {
       notify_command = argv + i + 1;
       break;
@@ -361,6 +467,11 @@ int CheckSettings() {
     Log("Saver module has not been specified in any way");
     return 0;
   }
+  configured_saver_executable = saver_executable;
+  if (daemon_mode && lock_client_mode) {
+    Log("Cannot be lock daemon and client at the same time");
+    return 0;
+  }
   return 1;
 }
 
@@ -519,6 +630,18 @@ int AcquireGrabs(Display *display, Window root_window, Window *ignored_windows,
   return ok;
 }
 
+/*! \brief Return the milliseconds passed since lock_request_time.
+ */
+long MillisecondsSinceLockRequest(void) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+    LogErrno("clock_gettime");
+    return 0;
+  }
+  return (now.tv_sec - lock_request_time.tv_sec) * 1000L +
+         (now.tv_nsec - lock_request_time.tv_nsec) / 1000000L;
+}
+
 /*! \brief Tell xss-lock or others that we're done locking.
  *
  * This enables xss-lock to delay going to sleep until the screen is actually
@@ -531,6 +654,7 @@ void NotifyOfLock(int xss_sleep_lock_fd) {
     if (close(xss_sleep_lock_fd) != 0) {
       LogErrno("close(XSS_SLEEP_LOCK_FD)");
     }
+    Log("Held the sleep lock for %ld ms", MillisecondsSinceLockRequest());
   }
   if (notify_command != NULL && *notify_command != NULL) {
     pid_t pid = ForkWithoutSigHandlers();
@@ -540,6 +664,7 @@ void NotifyOfLock(int xss_sleep_lock_fd) {
       // Child process.
       execvp(notify_command[0], notify_command);
       LogErrno("execvp");
+      FinishLog();
       _exit(EXIT_FAILURE);
     } else {
       // Parent process after successful fork.
@@ -548,11 +673,289 @@ void NotifyOfLock(int xss_sleep_lock_fd) {
   }
 }
 
+/*! \brief Shows the background effect snapshot behind the saver, if any.
+ */
+void ShowBackgroundEffect(Display *display, Window background_window,
+                          Window saver_window, Pixmap pixmap) {
+  if (pixmap == None) {
+    return;
+  }
+  XSetWindowBackgroundPixmap(display, background_window, pixmap);
+  XSetWindowBackgroundPixmap(display, saver_window, pixmap);
+  // In case dimming already mapped it.
+  XClearWindow(display, background_window);
+}
+
+/*! \brief Goes back to black windows, and frees the snapshot.
+ */
+void ClearBackgroundEffect(Display *display, Window background_window,
+                           Window saver_window, unsigned long black_pixel,
+                           Pixmap *pixmap) {
+  if (*pixmap == None) {
+    return;
+  }
+  XSetWindowBackground(display, background_window, black_pixel);
+  XSetWindowBackground(display, saver_window, black_pixel);
+  XClearWindow(display, background_window);
+  XFreePixmap(display, *pixmap);
+  *pixmap = None;
+}
+
+/*! \brief Undoes what the dim effect did outside the dim window.
+ *
+ * Handles a SIGTERM that arrived while dimming, i.e. may not return.
+ */
+void UndoDimEffect(Display *display, struct DimEffect *dimmer) {
+  dimmer->Cleanup(dimmer, display);
+  XSync(display, False);
+  dimming = 0;
+  if (dim_interrupted_by) {
+    HandleSIGTERM(dim_interrupted_by);
+  }
+}
+
+/*! \brief Dim the screen on the given window, unless the user becomes active.
+ *
+ * \param dim_window The window to dim on; it will become the background window.
+ * \return True if dimming completed and the screen should be locked, false if
+ *   the user became active. If true, call UndoDimEffect once the dim window
+ *   covers the screen otherwise.
+ */
+int DimBeforeLock(Display *display, Window root_window, Window dim_window,
+                  struct DimEffect *dimmer, int w, int h) {
+  uint64_t prev_idle = GetIdleTime(display, root_window);
+  if (prev_idle == (uint64_t)-1) {
+    Log("Could not initialize idle timers. Locking without dimming");
+    return 1;
+  }
+  dimming = 1;
+  // Windows closing above us uncover parts of what we drew; the main loop
+  // doesn't want these events though.
+  XWindowAttributes dim_attrs;
+  long event_mask = XGetWindowAttributes(display, dim_window, &dim_attrs)
+                        ? dim_attrs.your_event_mask
+                        : NoEventMask;
+  XSelectInput(display, dim_window, event_mask | ExposureMask);
+  XMapRaised(display, dim_window);
+  int i;
+  int completed = 1;
+  for (i = 0; i < dimmer->frame_count; ++i) {
+    RepaintDimExposures(dimmer, display, dim_window);
+    // Advance the dim pattern by one step.
+    dimmer->DrawFrame(dimmer, display, dim_window, i, w, h);
+    // Draw it!
+    XFlush(display);
+    SleepDimFrame(dimmer);
+    if (dim_interrupted_by) {
+      UndoDimEffect(display, dimmer);
+    }
+    // Any activity cancels the lock.
+    uint64_t cur_idle = GetIdleTime(display, root_window);
+    if (cur_idle < prev_idle) {
+      UndoDimEffect(display, dimmer);
+      completed = 0;
+      break;
+    }
+    prev_idle = cur_idle;
+  }
+  XSelectInput(display, dim_window, event_mask);
+  XSync(display, False);
+  XEvent ev;
+  while (XCheckTypedWindowEvent(display, dim_window, Expose, &ev)) {
+  }
+  return completed;
+}
+
+/*! \brief Initialize XInput so we can get multibyte key events.
+ *
+ * This may have to talk to an input method server, which can take a while, so
+ * it should not be done before the screen is locked.
+ *
+ * \param auth_window The window to draw input method stuff in.
+ * \param xim Receives the input method, or NULL.
+ * \param xic Receives the input context, or NULL.
+ */
+void InitInputMethod(Display *display, Window auth_window, XIM *xim,
+                     XIC *xic) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  *xim = XOpenIM(display, NULL, NULL, NULL);
+  if (*xim == NULL) {
+    Log("XOpenIM failed. Assuming Latin-1 encoding");
+  }
+  *xic = NULL;
+  if (*xim != NULL) {
+    // As we're OverrideRedirect and grabbing input, we can't use any fancy IMs.
+    // Therefore, if we can't get a requirement-less IM, we won't use XIM at
+    // all.
+    int input_styles[4] = {
+        XIMPreeditNothing | XIMStatusNothing,  // Status might be invisible.
+        XIMPreeditNothing | XIMStatusNone,     // Maybe a compose key.
+        XIMPreeditNone | XIMStatusNothing,     // Status might be invisible.
+        XIMPreeditNone | XIMStatusNone         // Standard handling.
+    };
+    size_t i;
+    for (i = 0; i < sizeof(input_styles) / sizeof(input_styles[0]); ++i) {
+      // Note: we draw XIM stuff in auth_window so it's above the saver/auth
+      // child. However, we receive events for the grab window.
+      *xic = XCreateIC(*xim, XNInputStyle, input_styles[i], XNClientWindow,
+                       auth_window, NULL);
+      if (*xic != NULL) {
+        break;
+      }
+    }
+    if (*xic == NULL) {
+      Log("XCreateIC failed. Assuming Latin-1 encoding");
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  Log("Input method setup took %ld ms",
+      (end.tv_sec - start.tv_sec) * 1000L +
+          (end.tv_nsec - start.tv_nsec) / 1000000L);
+}
+
+#ifdef HAVE_XCOMPOSITE_EXT
+/*! \brief Take over the composite overlay window to draw above compositors.
+ *
+ * Also creates the obscurer window if enabled.
+ *
+ * \param coverattrs The window attributes for the obscurer window.
+ * \param composite_window Receives the composite overlay window.
+ * \param obscurer_window Receives the obscurer window, or None.
+ */
+void AcquireCompositeOverlay(Display *display, Window root_window,
+                             const XSetWindowAttributes *coverattrs, int w,
+                             int h, int argc, char **argv,
+                             Window *composite_window,
+                             Window *obscurer_window) {
+  *composite_window = XCompositeGetOverlayWindow(display, root_window);
+  // Some compositers may unmap or shape the overlay window - undo that, just
+  // in case.
+  XMapRaised(display, *composite_window);
+#ifdef HAVE_XFIXES_EXT
+  int xfixes_event_base, xfixes_error_base;
+  if (XFixesQueryExtension(display, &xfixes_event_base, &xfixes_error_base)) {
+    XFixesSetWindowShapeRegion(display, *composite_window, ShapeBounding,  //
+                               0, 0, 0);
+  }
+#endif
+
+  *obscurer_window = None;
+  if (composite_obscurer) {
+    // Also create an "obscurer window" that we don't actually use but that
+    // covers almost everything in case the composite window temporarily does
+    // not work (e.g. in case the compositor hides the COW).  We are making
+    // the obscurer window actually white, so issues like this become visible
+    // but harmless. The window isn't full-sized to avoid compositors turning
+    // off themselves in response to a full-screen window, but nevertheless
+    // this is kept opt-in for now until shown reliable.
+    XSetWindowAttributes obscurerattrs = *coverattrs;
+    obscurerattrs.background_pixel =
+        WhitePixel(display, DefaultScreen(display));
+    *obscurer_window = XCreateWindow(
+        display, root_window, 1, 1, w - 2, h - 2, 0, CopyFromParent,
+        InputOutput, CopyFromParent,
+        CWBackPixel | CWSaveUnder | CWOverrideRedirect | CWCursor,
+        &obscurerattrs);
+    SetWMProperties(display, *obscurer_window, "xsecurelock", "obscurer", argc,
+                    argv);
+  }
+
+  // Let's get notified if we lose visibility, so we can self-raise.
+  XSelectInput(display, *composite_window,
+               StructureNotifyMask | VisibilityChangeMask);
+  if (*obscurer_window != None) {
+    XSelectInput(display, *obscurer_window,
+                 StructureNotifyMask | VisibilityChangeMask);
+  }
+
+  // Also set the bypass compositor property on the Composite Overlay Window,
+  // just in case a compositor were to try compositing it (xcompmgr does, but
+  // doesn't know this property anyway).
+  // Note: NOT setting this on the obscurer window, as this is a fallback and
+  // actually should be composited to make sure the compositor never draws
+  // anything "interesting".
+  Atom dont_composite_atom =
+      XInternAtom(display, "_NET_WM_BYPASS_COMPOSITOR", False);
+  long dont_composite = 1;
+  XChangeProperty(display, *composite_window, dont_composite_atom, XA_CARDINAL,
+                  32, PropModeReplace, (const unsigned char *)&dont_composite,
+                  1);
+}
+
+/*! \brief Give back the composite overlay window and the obscurer window.
+ */
+void ReleaseCompositeOverlay(Display *display, Window *composite_window,
+                             Window *obscurer_window) {
+  if (*obscurer_window != None) {
+    // Destroy the obscurer window first so it should never become visible.
+    XDestroyWindow(display, *obscurer_window);
+    *obscurer_window = None;
+  }
+  if (*composite_window != None) {
+    XCompositeReleaseOverlayWindow(display, *composite_window);
+    *composite_window = None;
+  }
+}
+#endif
+
+/*! \brief Wait for a lock request while in daemon mode.
+ *
+ * Meanwhile, the (unmapped) windows are kept at the size of the root window, so
+ * that locking only has to grab and map them.
+ *
+ * \param listen_fd The control socket.
+ * \param w The width of the root window; updated on changes.
+ * \param h The height of the root window; updated on changes.
+ */
+void WaitForLockRequest(Display *display, Window root_window, int listen_fd,
+                        Window background_window, Window saver_window,
+                        Window auth_window, int *w, int *h) {
+  int x11_fd = ConnectionNumber(display);
+  for (;;) {
+    while (XPending(display)) {
+      XEvent ev;
+      XNextEvent(display, &ev);
+      if (ev.type == ConfigureNotify && ev.xconfigure.window == root_window) {
+        *w = ev.xconfigure.width;
+        *h = ev.xconfigure.height;
+        XMoveResizeWindow(display, background_window, 0, 0, *w, *h);
+        XMoveResizeWindow(display, saver_window, 0, 0, *w, *h);
+        XMoveResizeWindow(display, auth_window, 0, 0, *w, *h);
+      }
+      // Everything else is left over from the previous lock, or irrelevant
+      // while not locked.
+    }
+    fd_set in_fds;
+    memset(&in_fds, 0, sizeof(in_fds));  // For clang-analyzer.
+    FD_ZERO(&in_fds);
+    FD_SET(x11_fd, &in_fds);
+    FD_SET(listen_fd, &in_fds);
+    // Come back soon to retry writing log messages stderr did not take yet.
+    struct timeval log_timeout = {0, LOG_FLUSH_INTERVAL_MS * 1000};
+    int log_pending = FlushLog();
+    if (select((x11_fd > listen_fd ? x11_fd : listen_fd) + 1, &in_fds, 0, 0,
+               log_pending ? &log_timeout : NULL) < 0) {
+      if (errno != EINTR) {
+        LogErrno("select");
+      }
+      continue;
+    }
+    if (FD_ISSET(listen_fd, &in_fds) && AcceptLockRequest(listen_fd, 0)) {
+      return;
+    }
+  }
+}
+
 /*! \brief The main program.
  *
  * Usage: see Usage().
  */
 int main(int argc, char **argv) {
+  if (clock_gettime(CLOCK_MONOTONIC, &lock_request_time) != 0) {
+    LogErrno("clock_gettime");
+  }
+
   setlocale(LC_CTYPE, "");
 
   int xss_sleep_lock_fd = GetIntSetting("XSS_SLEEP_LOCK_FD", -1);
@@ -598,6 +1001,16 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  // As a client, just ask the lock daemon to lock, and wait until it unlocks.
+  if (lock_client_mode) {
+    int lock_fd = RequestLockFromDaemon();
+    if (lock_fd == -1 || !WaitForLockDaemon(lock_fd, LOCK_DAEMON_LOCKED)) {
+      return 1;
+    }
+    NotifyOfLock(xss_sleep_lock_fd);
+    return WaitForLockDaemon(lock_fd, LOCK_DAEMON_UNLOCKED) ? EXIT_SUCCESS : 1;
+  }
+
   // Connect to X11.
   Display *display = XOpenDisplay(NULL);
   if (display == NULL) {
@@ -645,6 +1058,29 @@ int main(int argc, char **argv) {
 
   Window parent_window = root_window;
 
+  // Dimming first only makes sense for locks that are not urgent.
+  if (dim_before_lock && daemon_mode) {
+    Log("XSECURELOCK_DIM_BEFORE_LOCK is not supported in daemon mode");
+    dim_before_lock = 0;
+  }
+  if (dim_before_lock && xss_sleep_lock_fd != -1) {
+    // Going to sleep. Lock right away.
+    dim_before_lock = 0;
+  }
+  struct DimEffect *dimmer = NULL;
+  if (dim_before_lock) {
+    InitIdleTime(display);
+    dimmer = InitDimEffect(display);
+  }
+
+  // The snapshot for the background effect has to be taken before anything of
+  // ours, including the composite overlay window, covers the screen.
+  Pixmap background_pixmap = None;
+  if (!daemon_mode) {
+    background_pixmap =
+        CreateBackgroundEffectPixmap(display, root_window, w, h);
+  }
+
 #ifdef HAVE_XCOMPOSITE_EXT
   int composite_event_base, composite_error_base, composite_major_version = 0,
                                                   composite_minor_version = 0;
@@ -663,40 +1099,12 @@ int main(int argc, char **argv) {
     have_xcomposite_ext = 0;
   }
   Window composite_window = None, obscurer_window = None;
-  if (have_xcomposite_ext) {
-    composite_window = XCompositeGetOverlayWindow(display, root_window);
-    // Some compositers may unmap or shape the overlay window - undo that, just
-    // in case.
-    XMapRaised(display, composite_window);
-#ifdef HAVE_XFIXES_EXT
-    int xfixes_event_base, xfixes_error_base;
-    if (XFixesQueryExtension(display, &xfixes_event_base, &xfixes_error_base)) {
-      XFixesSetWindowShapeRegion(display, composite_window, ShapeBounding,  //
-                                 0, 0, 0);
-    }
-#endif
+  // The lock daemon only takes over the composite overlay window while locked,
+  // as it would otherwise cover the desktop. Same while dimming.
+  if (have_xcomposite_ext && !daemon_mode && !dim_before_lock) {
+    AcquireCompositeOverlay(display, root_window, &coverattrs, w, h, argc, argv,
+                            &composite_window, &obscurer_window);
     parent_window = composite_window;
-
-    if (composite_obscurer) {
-      // Also create an "obscurer window" that we don't actually use but that
-      // covers almost everything in case the composite window temporarily does
-      // not work (e.g. in case the compositor hides the COW).  We are making
-      // the obscurer window actually white, so issues like this become visible
-      // but harmless. The window isn't full-sized to avoid compositors turning
-      // off themselves in response to a full-screen window, but nevertheless
-      // this is kept opt-in for now until shown reliable.
-      XSetWindowAttributes obscurerattrs = coverattrs;
-      obscurerattrs.background_pixel =
-          WhitePixel(display, DefaultScreen(display));
-      obscurer_window = XCreateWindow(
-          display, root_window, 1, 1, w - 2, h - 2, 0, CopyFromParent,
-          InputOutput, CopyFromParent,
-          CWBackPixel | CWSaveUnder | CWOverrideRedirect | CWCursor,
-          &obscurerattrs);
-      SetWMProperties(display, obscurer_window, "xsecurelock", "obscurer", argc,
-                      argv);
-      my_windows[n_my_windows++] = obscurer_window;
-    }
   }
 #endif
 
@@ -707,12 +1115,28 @@ int main(int argc, char **argv) {
   // auth_window is a window exclusively used by the auth child. It will only be
   // mapped during auth, and hidden otherwise. These windows are separated
   // because XScreenSaver's savers might XUngrabKeyboard on their window.
-  Window background_window = XCreateWindow(
-      display, parent_window, 0, 0, w, h, 0, CopyFromParent, InputOutput,
-      CopyFromParent, CWBackPixel | CWSaveUnder | CWOverrideRedirect | CWCursor,
-      &coverattrs);
+  // When dimming first, background_window starts out as the dim window.
+  Window background_window;
+  if (dimmer != NULL) {
+    XSetWindowAttributes dimattrs = {0};
+    dimattrs.save_under = 1;
+    dimattrs.override_redirect = 1;
+    unsigned long dimmask = CWSaveUnder | CWOverrideRedirect;
+    dimmer->PreCreateWindow(dimmer, display, &dimattrs, &dimmask);
+    background_window =
+        XCreateWindow(display, parent_window, 0, 0, w, h, 0, CopyFromParent,
+                      InputOutput, CopyFromParent, dimmask, &dimattrs);
+  } else {
+    background_window = XCreateWindow(
+        display, parent_window, 0, 0, w, h, 0, CopyFromParent, InputOutput,
+        CopyFromParent,
+        CWBackPixel | CWSaveUnder | CWOverrideRedirect | CWCursor, &coverattrs);
+  }
   SetWMProperties(display, background_window, "xsecurelock", "background", argc,
                   argv);
+  if (dimmer != NULL) {
+    dimmer->PostCreateWindow(dimmer, display, background_window);
+  }
   my_windows[n_my_windows++] = background_window;
   Window saver_window =
       XCreateWindow(display, background_window, 0, 0, w, h, 0, CopyFromParent,
@@ -726,23 +1150,17 @@ int main(int argc, char **argv) {
   SetWMProperties(display, auth_window, "xsecurelock", "auth", argc, argv);
   my_windows[n_my_windows++] = auth_window;
 
-// Let's get notified if we lose visibility, so we can self-raise.
-#ifdef HAVE_XCOMPOSITE_EXT
-  if (composite_window != None) {
-    XSelectInput(display, composite_window,
-                 StructureNotifyMask | VisibilityChangeMask);
-  }
-  if (obscurer_window != None) {
-    XSelectInput(display, obscurer_window,
-                 StructureNotifyMask | VisibilityChangeMask);
-  }
-#endif
+  // Let's get notified if we lose visibility, so we can self-raise.
   XSelectInput(display, background_window,
                StructureNotifyMask | VisibilityChangeMask);
   XSelectInput(display, saver_window, StructureNotifyMask);
   XSelectInput(display, auth_window,
                StructureNotifyMask | VisibilityChangeMask);
 
+  // The helpers get the monitor configuration from us.
+  SelectMonitorChangeEvents(display, root_window);
+  Window monitor_windows[2] = {saver_window, auth_window};
+
   // Make sure we stay always on top.
   XWindowChanges coverchanges;
   coverchanges.stack_mode = Above;
@@ -757,57 +1175,22 @@ int main(int argc, char **argv) {
   XChangeProperty(display, background_window, state_atom, XA_ATOM, 32,
                   PropModeReplace, (const unsigned char *)&fullscreen_atom, 1);
 
-  // Bypass compositing, just in case.
+  // Bypass compositing, just in case. Not while dimming though, as that may
+  // need the compositor.
   Atom dont_composite_atom =
       XInternAtom(display, "_NET_WM_BYPASS_COMPOSITOR", False);
   long dont_composite = 1;
-  XChangeProperty(display, background_window, dont_composite_atom, XA_CARDINAL,
-                  32, PropModeReplace, (const unsigned char *)&dont_composite,
-                  1);
-#ifdef HAVE_XCOMPOSITE_EXT
-  if (composite_window != None) {
-    // Also set this property on the Composite Overlay Window, just in case a
-    // compositor were to try compositing it (xcompmgr does, but doesn't know
-    // this property anyway).
-    XChangeProperty(display, composite_window, dont_composite_atom, XA_CARDINAL,
-                    32, PropModeReplace, (const unsigned char *)&dont_composite,
-                    1);
-  }
-// Note: NOT setting this on the obscurer window, as this is a fallback and
-// actually should be composited to make sure the compositor never draws
-// anything "interesting".
-#endif
-
-  // Initialize XInput so we can get multibyte key events.
-  XIM xim = XOpenIM(display, NULL, NULL, NULL);
-  if (xim == NULL) {
-    Log("XOpenIM failed. Assuming Latin-1 encoding");
+  if (dimmer == NULL) {
+    XChangeProperty(display, background_window, dont_composite_atom,
+                    XA_CARDINAL, 32, PropModeReplace,
+                    (const unsigned char *)&dont_composite, 1);
   }
+
+  // The input method is initialized only once locked, as talking to the IM
+  // server can take a while. Until then, key events are decoded as Latin-1.
+  XIM xim = NULL;
   XIC xic = NULL;
-  if (xim != NULL) {
-    // As we're OverrideRedirect and grabbing input, we can't use any fancy IMs.
-    // Therefore, if we can't get a requirement-less IM, we won't use XIM at
-    // all.
-    int input_styles[4] = {
-        XIMPreeditNothing | XIMStatusNothing,  // Status might be invisible.
-        XIMPreeditNothing | XIMStatusNone,     // Maybe a compose key.
-        XIMPreeditNone | XIMStatusNothing,     // Status might be invisible.
-        XIMPreeditNone | XIMStatusNone         // Standard handling.
-    };
-    size_t i;
-    for (i = 0; i < sizeof(input_styles) / sizeof(input_styles[0]); ++i) {
-      // Note: we draw XIM stuff in auth_window so it's above the saver/auth
-      // child. However, we receive events for the grab window.
-      xic = XCreateIC(xim, XNInputStyle, input_styles[i], XNClientWindow,
-                      auth_window, NULL);
-      if (xic != NULL) {
-        break;
-      }
-    }
-    if (xic == NULL) {
-      Log("XCreateIC failed. Assuming Latin-1 encoding");
-    }
-  }
+  int auth_prepared = 0;
 
 #ifdef HAVE_XSCREENSAVER_EXT
   // If we support the screen saver extension, that'd be good.
@@ -820,12 +1203,121 @@ int main(int argc, char **argv) {
   XScreenSaverSelectInput(display, background_window, ScreenSaverNotifyMask);
 #endif
 
+  if (MLOCK_PAGE(&priv, sizeof(priv)) < 0) {
+    LogErrno("mlock");
+    return 1;
+  }
+
+  // Prevent X11 errors from killing XSecureLock. Instead, just keep going.
+  XSetErrorHandler(IgnoreErrorsHandler);
+
+  struct sigaction sa;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
+  sa.sa_handler = SIG_IGN;  // Don't die if auth child closes stdin.
+  if (sigaction(SIGPIPE, &sa, NULL) != 0) {
+    LogErrno("sigaction(SIGPIPE)");
+  }
+  sa.sa_flags = SA_RESETHAND;     // It re-raises to suicide.
+  sa.sa_handler = HandleSIGTERM;  // To kill children.
+  if (sigaction(SIGTERM, &sa, NULL) != 0) {
+    LogErrno("sigaction(SIGTERM)");
+  }
+
+  InitWaitPgrp();
+  InitKeyCommands();
+  InitSaverCgroup();
+  if (suspend_saver_on_blank) {
+    // The saver is saver_multiplex, which has to stop its own savers.
+    SuspendSaverChildrenByRequest();
+  }
+
+  int x11_fd = ConnectionNumber(display);
+
+  if (x11_fd == xss_sleep_lock_fd && xss_sleep_lock_fd != -1) {
+    Log("XSS_SLEEP_LOCK_FD matches DISPLAY - what?!? We're probably "
+        "inhibiting sleep now");
+    xss_sleep_lock_fd = -1;
+  }
+
+  // In daemon mode, everything up to here is done only once; each lock request
+  // then only needs to grab and map.
+  int daemon_fd = -1;
+  if (daemon_mode) {
+    daemon_fd = ListenForLockRequests();
+    if (daemon_fd == -1) {
+      return 1;
+    }
+  }
+  unsigned int n_my_permanent_windows = n_my_windows;
+  // Set if a lock request could not be fulfilled, to keep the daemon running.
+  int lock_failed;
+
+  if (dimmer != NULL) {
+    if (!DimBeforeLock(display, root_window, background_window, dimmer, w, h)) {
+      // Just like until_nonidle: no longer idle, so don't lock.
+      return EXIT_SUCCESS;
+    }
+    // Turn the dim window into the background window without unmapping it.
+    XSetWindowBackground(display, background_window, black.pixel);
+    XDefineCursor(display, background_window, transparent_cursor);
+    XDeleteProperty(display, background_window,
+                    XInternAtom(display, "_NET_WM_WINDOW_OPACITY", False));
+    XClearWindow(display, background_window);
+    // Only now, so nothing of the screen shows in between.
+    UndoDimEffect(display, dimmer);
+    XChangeProperty(display, background_window, dont_composite_atom,
+                    XA_CARDINAL, 32, PropModeReplace,
+                    (const unsigned char *)&dont_composite, 1);
+#ifdef HAVE_XCOMPOSITE_EXT
+    if (have_xcomposite_ext) {
+      AcquireCompositeOverlay(display, root_window, &coverattrs, w, h, argc,
+                              argv, &composite_window, &obscurer_window);
+      XReparentWindow(display, background_window, composite_window, 0, 0);
+    }
+#endif
+    // The lock only gets requested now.
+    if (clock_gettime(CLOCK_MONOTONIC, &lock_request_time) != 0) {
+      LogErrno("clock_gettime");
+    }
+  }
+
+next_lock:
+  lock_failed = 0;
+  // A saver only falls back to FALLBACK_SAVER_EXECUTABLE for one lock.
+  saver_executable = configured_saver_executable;
+  if (daemon_mode) {
+    WaitForLockRequest(display, root_window, daemon_fd, background_window,
+                       saver_window, auth_window, &w, &h);
+    if (clock_gettime(CLOCK_MONOTONIC, &lock_request_time) != 0) {
+      LogErrno("clock_gettime");
+    }
+    background_pixmap =
+        CreateBackgroundEffectPixmap(display, root_window, w, h);
+#ifdef HAVE_XCOMPOSITE_EXT
+    if (have_xcomposite_ext) {
+      AcquireCompositeOverlay(display, root_window, &coverattrs, w, h, argc,
+                              argv, &composite_window, &obscurer_window);
+      XReparentWindow(display, background_window, composite_window, 0, 0);
+    }
+#endif
+  }
+#ifdef HAVE_XCOMPOSITE_EXT
+  if (obscurer_window != None) {
+    my_windows[n_my_windows++] = obscurer_window;
+  }
+#endif
+
 #ifdef HAVE_XF86MISC_EXT
   // In case keys to disable grabs are available, turn them off for the duration
   // of the lock.
   if (XF86MiscSetGrabKeysState(display, False) != MiscExtGrabStateSuccess) {
     Log("Could not set grab keys state");
-    return 1;
+    if (!daemon_mode) {
+      return 1;
+    }
+    lock_failed = 1;
+    goto done;
   }
 #endif
 
@@ -844,12 +1336,18 @@ int main(int argc, char **argv) {
   }
   if (retries < 0) {
     Log("Failed to grab. Giving up.");
-    return 1;
+    if (!daemon_mode) {
+      return 1;
+    }
+    lock_failed = 1;
+    goto done;
   }
 
   // Map our windows.
   // This is done after grabbing so failure to grab does not blank the screen
   // yet, thereby "confirming" the screen lock.
+  ShowBackgroundEffect(display, background_window, saver_window,
+                       background_pixmap);
   XMapRaised(display, background_window);
   XMapRaised(display, saver_window);
   XRaiseWindow(display, auth_window);  // Don't map here.
@@ -861,55 +1359,52 @@ int main(int argc, char **argv) {
   }
 #endif
 
-  if (MLOCK_PAGE(&priv, sizeof(priv)) < 0) {
-    LogErrno("mlock");
-    return 1;
-  }
-
-  // Prevent X11 errors from killing XSecureLock. Instead, just keep going.
-  XSetErrorHandler(IgnoreErrorsHandler);
+  // Tell the helpers about the monitors, so they need not ask XRandR.
+  PublishMonitors(display, monitor_windows, 2);
 
-  struct sigaction sa;
-  sigemptyset(&sa.sa_mask);
-  sa.sa_flags = 0;
-  sa.sa_handler = SIG_IGN;  // Don't die if auth child closes stdin.
-  if (sigaction(SIGPIPE, &sa, NULL) != 0) {
-    LogErrno("sigaction(SIGPIPE)");
-  }
-  sa.sa_flags = SA_RESETHAND;     // It re-raises to suicide.
-  sa.sa_handler = HandleSIGTERM;  // To kill children.
-  if (sigaction(SIGTERM, &sa, NULL) != 0) {
-    LogErrno("sigaction(SIGTERM)");
-  }
-
-  InitWaitPgrp();
-
-  // Need to flush the display so savers sure can access the window.
-  XFlush(display);
+  // Wait for the server to process the mapping, so the events confirming the
+  // lock are already queued and the sleep lock can be released right away.
+  // This also makes sure savers can access the window and the monitors.
+  XSync(display, False);
 
   enum WatchChildrenState requested_saver_state = WATCH_CHILDREN_NORMAL;
-  int x11_fd = ConnectionNumber(display);
-
-  if (x11_fd == xss_sleep_lock_fd && xss_sleep_lock_fd != -1) {
-    Log("XSS_SLEEP_LOCK_FD matches DISPLAY - what?!? We're probably "
-        "inhibiting sleep now");
-    xss_sleep_lock_fd = -1;
-  }
-
   int background_window_mapped = 0, background_window_visible = 0,
       auth_window_mapped = 0, saver_window_mapped = 0,
-      need_to_reinstate_grabs = 0, xss_lock_notified = 0;
+      need_to_reinstate_grabs = 0, xss_lock_notified = 0,
+      watching_children = 0;
   for (;;) {
     // Watch children WATCH_CHILDREN_HZ times per second.
     fd_set in_fds;
     memset(&in_fds, 0, sizeof(in_fds));  // For clang-analyzer.
     FD_ZERO(&in_fds);
     FD_SET(x11_fd, &in_fds);
+    if (daemon_fd != -1) {
+      FD_SET(daemon_fd, &in_fds);
+    }
     struct timeval tv;
-    tv.tv_usec = 1000000 / WATCH_CHILDREN_HZ;
+    // Do not wait if there are queued events already.
+    tv.tv_usec = XQLength(display) > 0 ? 0 : 1000000 / WATCH_CHILDREN_HZ;
     tv.tv_sec = 0;
-    select(x11_fd + 1, &in_fds, 0, 0, &tv);
-    if (WatchChildren(display, auth_window, saver_window, requested_saver_state,
+    FlushLog();
+    if (select((x11_fd > daemon_fd ? x11_fd : daemon_fd) + 1, &in_fds, 0, 0,
+               &tv) > 0 &&
+        daemon_fd != -1 && FD_ISSET(daemon_fd, &in_fds)) {
+      // Another lock request while locked; answer it once we are locked.
+      AcceptLockRequest(daemon_fd, xss_lock_notified);
+    }
+    // Only start the saver once the lock is confirmed, unless that is taking
+    // unusually long.
+    if (!watching_children &&
+        MillisecondsSinceLockRequest() >= SAVER_START_MAX_DELAY_MS) {
+      Log("Lock not confirmed yet; starting saver anyway");
+      if (!auth_prepared) {
+        InitInputMethod(display, auth_window, &xim, &xic);
+        auth_prepared = 1;
+      }
+      watching_children = 1;
+    }
+    if (watching_children &&
+        WatchChildren(display, auth_window, saver_window, requested_saver_state,
                       NULL)) {
       goto done;
     }
@@ -950,8 +1445,10 @@ int main(int argc, char **argv) {
       WaitProc("notify", &notify_command_pid, 0, 0, &status);
       // Otherwise, we're still alive. Re-check next time.
     }
+    WaitKeyCommands();
 
     // Handle all events.
+    int root_configures = 0;
     while (XPending(display) && (XNextEvent(display, &priv.ev), 1)) {
       if (XFilterEvent(&priv.ev, None)) {
         // If an input method ate the event, ignore it.
@@ -965,19 +1462,11 @@ int main(int argc, char **argv) {
               priv.ev.xconfigure.width, priv.ev.xconfigure.height);
 #endif
           if (priv.ev.xconfigure.window == root_window) {
-            // Root window size changed. Adjust the saver_window window too!
+            // Root window size changed. Adjust our windows once all queued
+            // events are handled, as these tend to come in bursts.
             w = priv.ev.xconfigure.width;
             h = priv.ev.xconfigure.height;
-#ifdef DEBUG_EVENTS
-            Log("DisplayWidthHeight %d %d", w, h);
-#endif
-#ifdef HAVE_XCOMPOSITE_EXT
-            if (obscurer_window != None) {
-              XMoveResizeWindow(display, obscurer_window, 1, 1, w - 2, h - 2);
-            }
-#endif
-            XMoveResizeWindow(display, background_window, 0, 0, w, h);
-            XMoveResizeWindow(display, saver_window, 0, 0, w, h);
+            ++root_configures;
             // Just in case - ConfigureNotify might also be sent for raising
           }
           // Also, whatever window has been reconfigured, should also be raised
@@ -1106,27 +1595,8 @@ int main(int argc, char **argv) {
             priv.buf[0] = 0;
             // We do check if something external wants to handle this key,
             // though.
-            const char *keyname = XKeysymToString(priv.keysym);
-            if (keyname != NULL) {
-              char buf[64];
-              int buflen = snprintf(buf, sizeof(buf),
-                                    "XSECURELOCK_KEY_%s_COMMAND", keyname);
-              if (buflen <= 0 || (size_t)buflen >= sizeof(buf)) {
-                Log("Wow, pretty long keysym names you got there");
-              } else {
-                const char *command = GetStringSetting(buf, "");
-                if (*command) {
-                  buflen = snprintf(buf, sizeof(buf),
-                                    "eval \"$XSECURELOCK_KEY_%s_COMMAND\" &",
-                                    keyname);
-                  if (buflen <= 0 || (size_t)buflen >= sizeof(buf)) {
-                    Log("Wow, pretty long keysym names you got there");
-                  } else {
-                    system(buf);
-                    do_wake_up = 0;
-                  }
-                }
-              }
+            if (RunKeyCommand(priv.keysym)) {
+              do_wake_up = 0;
             }
           }
           // Now if so desired, wake up the login prompt, and check its
@@ -1145,6 +1615,7 @@ int main(int argc, char **argv) {
         case MappingNotify:
         case EnterNotify:
         case LeaveNotify:
+        case ReparentNotify:
           // Ignored.
           break;
         case MapNotify:
@@ -1245,20 +1716,90 @@ int main(int argc, char **argv) {
             break;
           }
 #endif
+          if (IsMonitorChangeEvent(display, &priv.ev)) {
+            NoteMonitorChange();
+            break;
+          }
           Log("Received unexpected event %d", priv.ev.type);
           break;
       }
       if (background_window_mapped && background_window_visible &&
           saver_window_mapped && !xss_lock_notified) {
         NotifyOfLock(xss_sleep_lock_fd);
+        xss_sleep_lock_fd = -1;  // Closed now; the next lock has none.
+        NotifyLockClients(LOCK_DAEMON_LOCKED);
         xss_lock_notified = 1;
+        // Only now that we're locked, set up the input method and start the
+        // saver.
+        if (!auth_prepared) {
+          InitInputMethod(display, auth_window, &xim, &xic);
+          auth_prepared = 1;
+        }
+        watching_children = 1;
+        if (WatchChildren(display, auth_window, saver_window,
+                          requested_saver_state, NULL)) {
+          goto done;
+        }
+      }
+    }
+    if (root_configures > 0) {
+      // Root window size changed. Adjust the saver_window window too!
+      if (root_configures > 1) {
+        Log("Coalesced %d root window size changes", root_configures);
+      }
+#ifdef DEBUG_EVENTS
+      Log("DisplayWidthHeight %d %d", w, h);
+#endif
+#ifdef HAVE_XCOMPOSITE_EXT
+      if (obscurer_window != None) {
+        XMoveResizeWindow(display, obscurer_window, 1, 1, w - 2, h - 2);
       }
+#endif
+      XMoveResizeWindow(display, background_window, 0, 0, w, h);
+      XMoveResizeWindow(display, saver_window, 0, 0, w, h);
+      // The snapshot no longer matches the screen.
+      ClearBackgroundEffect(display, background_window, saver_window,
+                            black.pixel, &background_pixmap);
+      // Monitors are published relative to the auth window too.
+      XMoveResizeWindow(display, auth_window, 0, 0, w, h);
+    }
+    if (MonitorChangeSettled(NULL)) {
+      PublishMonitors(display, monitor_windows, 2);
     }
   }
 
 done:
   // Wipe the password.
   explicit_bzero(&priv, sizeof(priv));
+  ClearBackgroundEffect(display, background_window, saver_window, black.pixel,
+                        &background_pixmap);
+
+  if (daemon_mode) {
+    // Unlock, but keep our windows for the next lock.
+    XUnmapWindow(display, auth_window);
+    XUnmapWindow(display, saver_window);
+    XUnmapWindow(display, background_window);
+    XUngrabKeyboard(display, CurrentTime);
+    XUngrabPointer(display, CurrentTime);
+#ifdef HAVE_XF86MISC_EXT
+    XF86MiscSetGrabKeysState(display, True);
+#endif
+#ifdef HAVE_XCOMPOSITE_EXT
+    if (composite_window != None) {
+      XReparentWindow(display, background_window, root_window, 0, 0);
+    }
+    ReleaseCompositeOverlay(display, &composite_window, &obscurer_window);
+#endif
+    n_my_windows = n_my_permanent_windows;
+    XSync(display, False);
+    if (lock_failed) {
+      // The clients will see the connection close without a lock.
+      DropLockClients();
+    } else {
+      NotifyLockClients(LOCK_DAEMON_UNLOCKED);
+    }
+    goto next_lock;
+  }
 
   // Free our resources, and exit.
   XDestroyWindow(display, auth_window);
@@ -1266,13 +1807,7 @@ done:
   XDestroyWindow(display, background_window);
 
 #ifdef HAVE_XCOMPOSITE_EXT
-  if (obscurer_window != None) {
-    // Destroy the obscurer window first so it should never become visible.
-    XDestroyWindow(display, obscurer_window);
-  }
-  if (composite_window != None) {
-    XCompositeReleaseOverlayWindow(display, composite_window);
-  }
+  ReleaseCompositeOverlay(display, &composite_window, &obscurer_window);
 #endif
 
   XFreeCursor(display, transparent_cursor);
@@ -0,0 +1,188 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "saver_cgroup.h"
+
+#include <errno.h>     // for errno, EEXIST
+#include <fcntl.h>     // for open, O_WRONLY
+#include <stdio.h>     // for snprintf, fopen, fgets, sscanf, fclose
+#include <string.h>    // for strcmp, strlen
+#include <sys/stat.h>  // for mkdir
+#include <time.h>      // for clock_gettime, timespec, CLOCK_MONOTONIC
+#include <unistd.h>    // for close, write
+
+#include "env_settings.h"  // for GetIntSetting, GetStringSetting
+#include "logging.h"       // for Log, LogErrno
+
+/*! \brief How long to average CPU usage over.
+ */
+#define SAVER_CPU_SAMPLE_MS 5000
+
+/*! \brief How many samples in a row may be over budget.
+ */
+#define SAVER_CPU_MAX_SAMPLES_OVER_BUDGET 6
+
+//! The saver cgroup directory, or empty if not using a cgroup.
+static char cgroup_path[4096];
+//! The CPU budget in percent of one CPU, or 0 for no budget.
+static int cpu_budget = 0;
+//! The cgroup's usage_usec at the start of the current sample.
+static unsigned long long sample_usage_usec = 0;
+//! The time the current sample started.
+static struct timespec sample_start;
+//! Whether sample_usage_usec and sample_start are set.
+static int have_sample = 0;
+//! How many samples in a row were over budget.
+static int samples_over_budget = 0;
+//! The number of OOM kills in the cgroup seen so far.
+static unsigned long long oom_kills = 0;
+
+static int CgroupFileName(char *buf, size_t size, const char *name) {
+  int len = snprintf(buf, size, "%s/%s", cgroup_path, name);
+  return len > 0 && (size_t)len < size;
+}
+
+static int WriteCgroupFile(const char *name, const char *value) {
+  char path[4096 + 32];
+  if (!CgroupFileName(path, sizeof(path), name)) {
+    return 0;
+  }
+  int fd = open(path, O_WRONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  size_t len = strlen(value);
+  int ok = write(fd, value, len) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+/*! \brief Reads a single "key value" entry from a cgroup stats file.
+ */
+static int ReadCgroupStat(const char *name, const char *key,
+                          unsigned long long *value) {
+  char path[4096 + 32];
+  if (!CgroupFileName(path, sizeof(path), name)) {
+    return 0;
+  }
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    return 0;
+  }
+  int found = 0;
+  char line[256];
+  while (!found && fgets(line, sizeof(line), f) != NULL) {
+    char line_key[64];
+    if (sscanf(line, "%63s %llu", line_key, value) == 2 &&
+        !strcmp(line_key, key)) {
+      found = 1;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+void InitSaverCgroup(void) {
+  const char *path = GetStringSetting("XSECURELOCK_SAVER_CGROUP", "");
+  if (!*path) {
+    return;
+  }
+  int len = snprintf(cgroup_path, sizeof(cgroup_path), "%s", path);
+  if (len <= 0 || (size_t)len >= sizeof(cgroup_path)) {
+    Log("Saver cgroup path is too long");
+    cgroup_path[0] = 0;
+    return;
+  }
+  if (mkdir(cgroup_path, 0755) != 0 && errno != EEXIST) {
+    LogErrno("mkdir(%s)", cgroup_path);
+    cgroup_path[0] = 0;
+    return;
+  }
+
+  const char *cpu_max = GetStringSetting("XSECURELOCK_SAVER_CPU_MAX", "");
+  if (*cpu_max && !WriteCgroupFile("cpu.max", cpu_max)) {
+    LogErrno("Could not set cpu.max of %s to %s", cgroup_path, cpu_max);
+  }
+  const char *memory_max =
+      GetStringSetting("XSECURELOCK_SAVER_MEMORY_MAX", "");
+  if (*memory_max && !WriteCgroupFile("memory.max", memory_max)) {
+    LogErrno("Could not set memory.max of %s to %s", cgroup_path, memory_max);
+  }
+
+  cpu_budget = GetIntSetting("XSECURELOCK_SAVER_CPU_BUDGET", 0);
+  ReadCgroupStat("memory.events", "oom_kill", &oom_kills);
+}
+
+void JoinSaverCgroup(void) {
+  if (!*cgroup_path) {
+    return;
+  }
+  // Writing 0 moves the writing process.
+  if (!WriteCgroupFile("cgroup.procs", "0")) {
+    LogErrno("Could not move saver into %s", cgroup_path);
+  }
+}
+
+int SaverCgroupOverBudget(void) {
+  if (!*cgroup_path) {
+    return 0;
+  }
+
+  // Memory limits are enforced by the kernel; just say why savers restart.
+  unsigned long long new_oom_kills;
+  if (ReadCgroupStat("memory.events", "oom_kill", &new_oom_kills) &&
+      new_oom_kills != oom_kills) {
+    Log("Saver exceeded its memory limit and got killed %llu times",
+        new_oom_kills - oom_kills);
+    oom_kills = new_oom_kills;
+  }
+
+  if (cpu_budget <= 0) {
+    return 0;
+  }
+  struct timespec now;
+  unsigned long long usage_usec;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) != 0 ||
+      !ReadCgroupStat("cpu.stat", "usage_usec", &usage_usec)) {
+    return 0;
+  }
+  if (!have_sample) {
+    sample_start = now;
+    sample_usage_usec = usage_usec;
+    have_sample = 1;
+    return 0;
+  }
+  long long elapsed_usec = (now.tv_sec - sample_start.tv_sec) * 1000000LL +
+                           (now.tv_nsec - sample_start.tv_nsec) / 1000;
+  if (elapsed_usec < SAVER_CPU_SAMPLE_MS * 1000LL) {
+    return 0;
+  }
+  int usage = (int)((usage_usec - sample_usage_usec) * 100 / elapsed_usec);
+  sample_start = now;
+  sample_usage_usec = usage_usec;
+  if (usage <= cpu_budget) {
+    samples_over_budget = 0;
+    return 0;
+  }
+  ++samples_over_budget;
+  Log("Saver used %d%% CPU over the last %d ms, budget is %d%%", usage,
+      (int)(elapsed_usec / 1000), cpu_budget);
+  if (samples_over_budget < SAVER_CPU_MAX_SAMPLES_OVER_BUDGET) {
+    return 0;
+  }
+  samples_over_budget = 0;
+  return usage;
+}
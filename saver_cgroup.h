@@ -0,0 +1,45 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SAVER_CGROUP_H
+#define SAVER_CGROUP_H
+
+/*! \brief Sets up the cgroup for saver children, if configured.
+ *
+ * Creates the cgroup v2 directory from $XSECURELOCK_SAVER_CGROUP if needed,
+ * and applies the CPU and memory limits to it. Without this call, saver
+ * children stay in the cgroup of their parent.
+ */
+void InitSaverCgroup(void);
+
+/*! \brief Moves the calling process into the saver cgroup.
+ *
+ * To be called in the saver child process right after forking; everything it
+ * spawns then inherits the cgroup.
+ */
+void JoinSaverCgroup(void);
+
+/*! \brief Samples the CPU usage of the saver cgroup.
+ *
+ * To be called regularly while savers are running. Usage is averaged over a
+ * few seconds at a time.
+ *
+ * \return The CPU usage (in percent of one CPU) if the savers stayed over the
+ *   $XSECURELOCK_SAVER_CPU_BUDGET for too long, or 0 otherwise.
+ */
+int SaverCgroupOverBudget(void);
+
+#endif
@@ -16,17 +16,36 @@ limitations under the License.
 
 #include "saver_child.h"
 
-#include <signal.h>  // for sigemptyset, sigprocmask, SIG_SETMASK
-#include <stdlib.h>  // for NULL, EXIT_FAILURE
-#include <unistd.h>  // for pid_t, _exit, execl, fork, setsid, sleep
+#include <sched.h>         // for sched_setscheduler, sched_param
+#include <signal.h>        // for SIGCONT, SIGSTOP, SIGTERM, SIGUSR1, SIG...
+#include <stdlib.h>        // for NULL, EXIT_FAILURE
+#include <string.h>        // for strcmp
+#include <sys/resource.h>  // for setpriority, PRIO_PROCESS
+#include <unistd.h>        // for pid_t, _exit, execl, fork, setsid, sleep
 
-#include "logging.h"           // for LogErrno, Log
+#include "env_settings.h"      // for GetStringSetting
+#include "logging.h"           // for LogErrno, Log, FinishLog
+#include "saver_cgroup.h"      // for JoinSaverCgroup
 #include "wait_pgrp.h"         // for KillPgrp, WaitPgrp
 #include "xscreensaver_api.h"  // for ExportWindowID
 
+#if defined(__linux__) && !defined(SCHED_IDLE)
+// Only declared with _GNU_SOURCE.
+#define SCHED_IDLE 5
+#endif
+
+//! The nice value of savers when not using the normal scheduling.
+#define SAVER_NICE 19
+
 //! The PIDs of currently running saver children, or 0 if not running.
 static pid_t saver_child_pid[MAX_SAVERS] = {0};
 
+//! Whether the saver children are currently suspended.
+static volatile sig_atomic_t saver_child_suspended[MAX_SAVERS] = {0};
+
+//! Whether saver children are suspended by request (SIGUSR2) or by SIGSTOP.
+static int saver_child_suspend_by_request = 0;
+
 void KillAllSaverChildrenSigHandler(int signo) {
   // This is a signal handler, so we're not going to make this too
   // complicated. Just kill 'em all.
@@ -34,7 +53,72 @@ void KillAllSaverChildrenSigHandler(int signo) {
   for (i = 0; i < MAX_SAVERS; ++i) {
     if (saver_child_pid[i] != 0) {
       KillPgrp(saver_child_pid[i], signo);
+      // A suspended saver only sees the signal once continued. SIGUSR1 can wait
+      // for that; anything else is meant to make it go away now.
+      if (saver_child_suspended[i] && signo != SIGUSR1) {
+        KillPgrp(saver_child_pid[i], SIGCONT);
+      }
+    }
+  }
+}
+
+void SuspendAllSaverChildrenSigHandler(int suspend) {
+  int i;
+  for (i = 0; i < MAX_SAVERS; ++i) {
+    if (saver_child_pid[i] != 0) {
+      KillPgrp(saver_child_pid[i], suspend ? SIGSTOP : SIGCONT);
+      saver_child_suspended[i] = suspend;
+    }
+  }
+}
+
+void SuspendSaverChild(int index, int suspend) {
+  if (index < 0 || index >= MAX_SAVERS) {
+    Log("Saver index out of range: !(0 <= %d < %d)", index, MAX_SAVERS);
+    return;
+  }
+
+  if (saver_child_pid[index] == 0 || saver_child_suspended[index] == suspend) {
+    return;
+  }
+  if (!suspend) {
+    KillPgrp(saver_child_pid[index], SIGCONT);
+  } else if (saver_child_suspend_by_request) {
+    // Only the leader knows its own savers, which are in separate sessions.
+    kill(saver_child_pid[index], SIGUSR2);
+  } else {
+    KillPgrp(saver_child_pid[index], SIGSTOP);
+  }
+  saver_child_suspended[index] = suspend;
+}
+
+void SuspendSaverChildrenByRequest(void) { saver_child_suspend_by_request = 1; }
+
+/*! \brief Lowers the priority of the calling saver child process.
+ *
+ * This keeps savers from slowing down the auth child and xsecurelock itself,
+ * which keep their normal priority.
+ */
+static void ApplySaverScheduling(void) {
+  const char *scheduling =
+      GetStringSetting("XSECURELOCK_SAVER_SCHEDULING", "normal");
+  if (!strcmp(scheduling, "normal")) {
+    return;
+  }
+  if (!strcmp(scheduling, "idle")) {
+#ifdef SCHED_IDLE
+    // On Linux, this also implies the idle I/O class unless set explicitly.
+    struct sched_param param = {0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == 0) {
+      return;
     }
+    LogErrno("sched_setscheduler(SCHED_IDLE)");
+#endif
+  } else if (strcmp(scheduling, "nice")) {
+    Log("Unknown saver scheduling %s; using nice", scheduling);
+  }
+  if (setpriority(PRIO_PROCESS, 0, SAVER_NICE) != 0) {
+    LogErrno("setpriority");
   }
 }
 
@@ -48,6 +132,10 @@ void WatchSaverChild(Display* dpy, Window w, int index, const char* executable,
   if (saver_child_pid[index] != 0) {
     if (!should_be_running) {
       KillPgrp(saver_child_pid[index], SIGTERM);
+      if (saver_child_suspended[index]) {
+        KillPgrp(saver_child_pid[index], SIGCONT);
+        saver_child_suspended[index] = 0;
+      }
     }
 
     int status;
@@ -56,6 +144,9 @@ void WatchSaverChild(Display* dpy, Window w, int index, const char* executable,
       // Now is the time to remove anything the child may have displayed.
       XClearWindow(dpy, w);
     }
+    if (saver_child_pid[index] == 0) {
+      saver_child_suspended[index] = 0;
+    }
   }
 
   if (should_be_running && saver_child_pid[index] == 0) {
@@ -64,14 +155,25 @@ void WatchSaverChild(Display* dpy, Window w, int index, const char* executable,
       LogErrno("fork");
     } else if (pid == 0) {
       // Child process.
+      JoinSaverCgroup();
+      ApplySaverScheduling();
       StartPgrp();
       ExportWindowID(w);
+      // Hold back suspend requests until the saver installed its handler.
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGUSR2);
+      if (sigprocmask(saver_child_suspend_by_request ? SIG_BLOCK : SIG_UNBLOCK,
+                      &set, NULL)) {
+        LogErrno("sigprocmask");
+      }
       execl(executable,  // Path to binary.
             executable,  // argv[0].
             "-root",     // argv[1]; for XScreenSaver hacks, unused by our own.
             NULL);
       LogErrno("execl");
       sleep(2);  // Reduce log spam or other effects from failed execl.
+      FinishLog();
       _exit(EXIT_FAILURE);
     } else {
       // Parent process after successful fork.
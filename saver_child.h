@@ -28,6 +28,36 @@ limitations under the License.
  */
 void KillAllSaverChildrenSigHandler(int signo);
 
+/*! \brief Suspend or continue all saver children.
+ *
+ * This can be used from a signal handler.
+ *
+ * \param suspend If true, the saver children get SIGSTOP; otherwise SIGCONT.
+ */
+void SuspendAllSaverChildrenSigHandler(int suspend);
+
+/*! \brief Suspends or continues the screen saver child process.
+ *
+ * Suspending sends SIGSTOP to the saver's process group, or SIGUSR2 to the
+ * saver itself after SuspendSaverChildrenByRequest. Continuing sends SIGCONT to
+ * the process group. WatchSaverChild also continues a suspended saver it kills,
+ * so it can actually terminate.
+ *
+ * \param index The index of the saver to suspend (0 <= index < MAX_SAVERS).
+ * \param suspend If true, suspend the saver; otherwise continue it.
+ */
+void SuspendSaverChild(int index, int suspend);
+
+/*! \brief Makes SuspendSaverChild ask the savers to suspend themselves.
+ *
+ * Needed when the saver runs further savers in their own sessions, which
+ * SIGSTOP on its process group does not reach; saver_multiplex handles SIGUSR2
+ * by stopping its savers and then itself. Savers started from now on begin
+ * with SIGUSR2 blocked, so a request sent before they installed their handler
+ * is not lost.
+ */
+void SuspendSaverChildrenByRequest(void);
+
 /*! \brief Starts or stops the screen saver child process.
  *
  * \param dpy The X11 display.
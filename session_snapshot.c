@@ -0,0 +1,188 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include "session_snapshot.h"
+
+#include <X11/Xlib.h>  // for XAllocNamedColor, DefaultColormap, XColor
+#include <errno.h>     // for errno, EINTR
+#include <fcntl.h>     // for fcntl, F_SETFD, FD_CLOEXEC
+#include <stdio.h>     // for snprintf
+#include <stdlib.h>    // for mkstemp, setenv, unsetenv
+#include <string.h>    // for memset, strcmp
+#include <sys/mman.h>  // for mmap, munmap, MAP_FAILED, MAP_SHARED, P...
+#include <sys/stat.h>  // for fstat, stat
+#include <unistd.h>    // for close, dup, pwrite, unlink, write
+
+#include "env_settings.h"  // for GetIntSetting, GetStringSetting
+#include "logging.h"       // for Log, LogErrno
+
+void AllocAuthColors(Display *display, XColor *background, XColor *foreground,
+                     XColor *warning) {
+  Colormap colormap = DefaultColormap(display, DefaultScreen(display));
+  XColor dummy;
+  XAllocNamedColor(
+      display, colormap,
+      GetStringSetting("XSECURELOCK_AUTH_BACKGROUND_COLOR", "black"),
+      background, &dummy);
+  XAllocNamedColor(
+      display, colormap,
+      GetStringSetting("XSECURELOCK_AUTH_FOREGROUND_COLOR", "white"),
+      foreground, &dummy);
+  XAllocNamedColor(display, colormap,
+                   GetStringSetting("XSECURELOCK_AUTH_WARNING_COLOR", "red"),
+                   warning, &dummy);
+}
+
+//! The descriptor of the exported or received snapshot, or -1.
+static int session_fd = -1;
+
+void InitSessionSnapshot(struct SessionSnapshot *snapshot) {
+  memset(snapshot, 0, sizeof(*snapshot));
+  snapshot->magic = SESSION_SNAPSHOT_MAGIC;
+  snapshot->version = SESSION_SNAPSHOT_VERSION;
+  snapshot->size = sizeof(*snapshot);
+}
+
+int ExportSessionSnapshot(const struct SessionSnapshot *snapshot) {
+  char path[4096];
+  const char *dir = GetStringSetting("XDG_RUNTIME_DIR", "");
+  if (!*dir) {
+    dir = "/tmp";
+  }
+  int len = snprintf(path, sizeof(path), "%s/xsecurelock-session.XXXXXX", dir);
+  if (len <= 0 || (size_t)len >= sizeof(path)) {
+    Log("Session snapshot path is too long");
+    return 0;
+  }
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    LogErrno("mkstemp(%s)", path);
+    return 0;
+  }
+  // The file has no name anymore once we're done here, and only the children
+  // that need it get a descriptor.
+  if (unlink(path) != 0) {
+    LogErrno("unlink(%s)", path);
+  }
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    LogErrno("fcntl(FD_CLOEXEC)");
+    close(fd);
+    return 0;
+  }
+  const char *data = (const char *)snapshot;
+  size_t remaining = sizeof(*snapshot);
+  while (remaining > 0) {
+    ssize_t n = write(fd, data, remaining);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LogErrno("write(session snapshot)");
+      close(fd);
+      return 0;
+    }
+    data += n;
+    remaining -= n;
+  }
+
+  if (session_fd != -1) {
+    close(session_fd);
+  }
+  session_fd = fd;
+  return 1;
+}
+
+void PassSessionSnapshot(void) {
+  if (session_fd == -1) {
+    return;
+  }
+  // Unlike session_fd, the duplicate survives exec.
+  int fd = dup(session_fd);
+  if (fd == -1) {
+    LogErrno("dup(session snapshot)");
+    return;
+  }
+  char fd_str[16];
+  snprintf(fd_str, sizeof(fd_str), "%d", fd);
+  setenv("XSECURELOCK_SESSION_FD", fd_str, 1);
+}
+
+const struct SessionSnapshot *GetSessionSnapshot(void) {
+  static int initialized = 0;
+  static const struct SessionSnapshot *snapshot = NULL;
+  if (initialized) {
+    return snapshot;
+  }
+  initialized = 1;
+
+  int fd = GetIntSetting("XSECURELOCK_SESSION_FD", -1);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    LogErrno("fstat(XSECURELOCK_SESSION_FD)");
+    return NULL;
+  }
+  if (st.st_size != (off_t)sizeof(*snapshot)) {
+    Log("Ignoring session snapshot of unexpected size");
+    return NULL;
+  }
+  void *data = mmap(NULL, sizeof(*snapshot), PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    LogErrno("mmap(XSECURELOCK_SESSION_FD)");
+    return NULL;
+  }
+  // Keep the descriptor for UpdateSessionSnapshot, but don't pass it on to our
+  // children.
+  unsetenv("XSECURELOCK_SESSION_FD");
+  if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+    LogErrno("fcntl(FD_CLOEXEC)");
+  }
+  const struct SessionSnapshot *s = data;
+  if (s->magic != SESSION_SNAPSHOT_MAGIC ||
+      s->version != SESSION_SNAPSHOT_VERSION || s->size != sizeof(*s)) {
+    Log("Ignoring session snapshot of a different version");
+    munmap(data, sizeof(*snapshot));
+    close(fd);
+    return NULL;
+  }
+  snapshot = s;
+  session_fd = fd;
+  return snapshot;
+}
+
+int UpdateSessionSnapshot(size_t offset, const void *data, size_t size) {
+  if (GetSessionSnapshot() == NULL || session_fd == -1 ||
+      offset + size > sizeof(struct SessionSnapshot)) {
+    return 0;
+  }
+  const char *bytes = data;
+  while (size > 0) {
+    ssize_t n = pwrite(session_fd, bytes, size, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      LogErrno("pwrite(session snapshot)");
+      return 0;
+    }
+    bytes += n;
+    offset += n;
+    size -= n;
+  }
+  return 1;
+}
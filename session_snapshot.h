@@ -0,0 +1,107 @@
+/*
+Copyright 2018 Google Inc. All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#ifndef SESSION_SNAPSHOT_H
+#define SESSION_SNAPSHOT_H
+
+#include <X11/Xlib.h>  // for Display, XColor
+#include <stddef.h>    // for size_t
+#include <stdint.h>    // for uint32_t
+
+//! Identifies a session snapshot.
+#define SESSION_SNAPSHOT_MAGIC 0x58534c53  // "XSLS"
+
+//! Bump this whenever struct SessionSnapshot changes.
+#define SESSION_SNAPSHOT_VERSION 2
+
+/*! \brief State resolved once per session and shared with the helpers.
+ *
+ * Helpers use this to skip X11 round trips at startup. Everything in here is
+ * optional; helpers fall back to doing the work themselves. xsecurelock fills
+ * in what it can get using X11 only; the first auth_x11 instance adds the
+ * resolved font for the instances after it.
+ */
+struct SessionSnapshot {
+  //! SESSION_SNAPSHOT_MAGIC.
+  uint32_t magic;
+  //! SESSION_SNAPSHOT_VERSION.
+  uint32_t version;
+  //! sizeof(struct SessionSnapshot), to catch mismatching builds.
+  uint32_t size;
+
+  //! Whether the auth_* colors are set.
+  int have_auth_colors;
+  //! The colors of the auth dialog, allocated by xsecurelock.
+  XColor auth_background, auth_foreground, auth_warning;
+
+  //! The Xft font name auth_font_pattern was resolved from.
+  char auth_font_name[256];
+  //! The fully resolved Xft pattern of the auth font; empty if not set.
+  char auth_font_pattern[16384];
+};
+
+/*! \brief Allocates the colors of the auth dialog from the auth color settings.
+ *
+ * \param display The display to allocate the colors on.
+ * \param background Receives the background color.
+ * \param foreground Receives the foreground color.
+ * \param warning Receives the warning color.
+ */
+void AllocAuthColors(Display *display, XColor *background, XColor *foreground,
+                     XColor *warning);
+
+/*! \brief Initializes an empty session snapshot.
+ */
+void InitSessionSnapshot(struct SessionSnapshot *snapshot);
+
+/*! \brief Makes the session snapshot available to PassSessionSnapshot.
+ *
+ * The snapshot is written to an unlinked file which stays open close-on-exec,
+ * so other children don't get it. Replaces a previously exported snapshot.
+ *
+ * Possible errors will be printed on stderr.
+ *
+ * \return True if the snapshot was exported.
+ */
+int ExportSessionSnapshot(const struct SessionSnapshot *snapshot);
+
+/*! \brief Hands the session snapshot to the program about to be executed.
+ *
+ * To be called in a child process between fork and exec. Exports a
+ * descriptor of the snapshot via $XSECURELOCK_SESSION_FD.
+ */
+void PassSessionSnapshot(void);
+
+/*! \brief Returns the session snapshot provided by xsecurelock.
+ *
+ * \return The snapshot, or NULL if there is none (e.g. if not running as a
+ *   child of xsecurelock, or if it is from a different version).
+ */
+const struct SessionSnapshot *GetSessionSnapshot(void);
+
+/*! \brief Writes to the session snapshot provided by xsecurelock.
+ *
+ * The change is seen by GetSessionSnapshot in later children of xsecurelock,
+ * and also in the own mapping.
+ *
+ * \param offset The offset of the data in struct SessionSnapshot.
+ * \param data The data to write.
+ * \param size The size of the data.
+ * \return True if the data was written.
+ */
+int UpdateSessionSnapshot(size_t offset, const void *data, size_t size);
+
+#endif
@@ -23,7 +23,7 @@ limitations under the License.
 #include <sys/wait.h>  // for waitpid, WNOHANG
 #include <unistd.h>    // for pid_t
 
-#include "logging.h"  // for Log, LogErrno
+#include "logging.h"  // for Log, LogErrno, FinishLog
 
 static void HandleSIGCHLD(int unused_signo) {
   // No handling needed - we just want to interrupt select() or sigsuspend()
@@ -105,6 +105,7 @@ void StartPgrp(void) {
     execl("pgrp_placeholder", "pgrp_placeholder", NULL);
     LogErrno("execl");
     sleep(2);  // Reduce log spam or other effects from failed execl.
+    FinishLog();
     _exit(EXIT_FAILURE);
   }
 }
@@ -145,6 +146,8 @@ int WaitProc(const char *name, pid_t *pid, int do_block, int already_killed,
   // handling reads the pid variable we are changing here.
   sigaddset(&set, SIGUSR1);
   sigaddset(&set, SIGTERM);
+  sigaddset(&set, SIGUSR2);
+  sigaddset(&set, SIGCONT);
   // If we want to wait for a process to die, we must also block SIGCHLD
   // so we can reliably wait for another child in case waitpid returned 0.
   // Why can't we just use 0 instead of WNOHANG? Because then we can't block
@@ -65,7 +65,7 @@ int KillPgrp(pid_t pid, int signo);
  * \param exit_status Variable that receives the exit status of the leader when
  *   it terminated. Will be negative for a signal, positive for a regular exit,
  *   or one of the WAIT_* constants.
- * \return True if the process group is still alive.
+ * \return True if the process group died, i.e. *pid was set to zero.
  */
 int WaitPgrp(const char *name, pid_t *pid, int do_block, int already_killed,
              int *exit_status);
@@ -76,11 +76,11 @@ int WaitPgrp(const char *name, pid_t *pid, int do_block, int already_killed,
  * \param pid The process ID; it is set to zero if the process died.
  * \param do_block Whether to wait for the process to terminate.
  * \param already_killed Whether the caller already sent SIGTERM to the process.
- *   If so, we will not log this signal as that'd be spam. \param exit_status
- *   Variable that receives the exit status of the leader when it terminated.
- *   Will be negative for a signal, positive for a regular exit, or one of the
- *   WAIT_* constants.
- * \return True if the process is still alive.
+ *   If so, we will not log this signal as that'd be spam.
+ * \param exit_status Variable that receives the exit status of the process
+ *   when it terminated. Will be negative for a signal, positive for a regular
+ *   exit, or one of the WAIT_* constants.
+ * \return True if the process died, i.e. *pid was set to zero.
  */
 int WaitProc(const char *name, pid_t *pid, int do_block, int already_killed,
              int *exit_status);